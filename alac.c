@@ -42,6 +42,14 @@ static const int host_bigendian = 0;
 
 #include "alac.h"
 
+#if defined(__SSE2__) || (defined(__GNUC__) && defined(__i386__))
+    #define ALAC_SSE2
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #define ALAC_NEON
+    #include <arm_neon.h>
+#endif
+
 #define _Swap32(v) do { \
                    v = (((v) & 0x000000FF) << 0x18) | \
                        (((v) & 0x0000FF00) << 0x08) | \
@@ -52,38 +60,95 @@ static const int host_bigendian = 0;
                    v = (((v) & 0x00FF) << 0x08) | \
                        (((v) & 0xFF00) >> 0x08); } while (0)
 
-struct {signed int x:24;} se_struct_24;
-#define SignExtend24(val) (se_struct_24.x = val)
+#define ALIGN_UP(x) (((x) + ALAC_ALIGN - 1) & ~(size_t)(ALAC_ALIGN - 1))
+
+/* each of the three per-channel buffers starts on its own cache line */
+static size_t buffer_stride(uint32_t max_samples_per_frame)
+{
+    return ALIGN_UP((size_t)max_samples_per_frame * 4);
+}
+
+size_t alac_buffers_size(int numchannels, uint32_t max_samples_per_frame)
+{
+    return 3 * numchannels * buffer_stride(max_samples_per_frame);
+}
+
+size_t alac_context_size(int numchannels, uint32_t max_samples_per_frame)
+{
+    return ALIGN_UP(sizeof(alac_file)) +
+           alac_buffers_size(numchannels, max_samples_per_frame);
+}
+
+static void attach_buffers(alac_file *alac, void *arena)
+{
+    size_t stride = buffer_stride(alac->setinfo_max_samples_per_frame);
+    unsigned char *p = arena;
+    int c;
+
+    alac->arena = arena;
+    /* all of a channel's buffers together */
+    for (c = 0; c < alac->numchannels; c++)
+    {
+        alac->predicterror_buffer[c] = (int32_t*)p;
+        p += stride;
+        alac->outputsamples_buffer[c] = (int32_t*)p;
+        p += stride;
+        alac->uncompressed_bytes_buffer[c] = (int32_t*)p;
+        p += stride;
+    }
+}
+
+static void init_context(alac_file *alac, int samplesize, int numchannels)
+{
+    memset(alac, 0, sizeof(alac_file));
+
+    /* callers are expected to check, but never overrun the buffer tables */
+    if (numchannels > ALAC_MAX_CHANNELS)
+        numchannels = ALAC_MAX_CHANNELS;
+
+    alac->samplesize = samplesize;
+    alac->numchannels = numchannels;
+    /* 20 bit samples are output in 24 bit containers */
+    alac->bytespersample = ((samplesize + 7) / 8) * numchannels;
+    alac->output_gain = (int64_t)0x10000 << 16;
+    alac->dither_state = 0x9e3779b9;
+}
 
 void alac_free(alac_file *alac) {
-    if (alac->predicterror_buffer_a)
-        free(alac->predicterror_buffer_a);
-    if (alac->predicterror_buffer_b)
-        free(alac->predicterror_buffer_b);
-
-    if (alac->outputsamples_buffer_a)
-        free(alac->outputsamples_buffer_a);
-    if (alac->outputsamples_buffer_b)
-        free(alac->outputsamples_buffer_b);
-
-    if (alac->uncompressed_bytes_buffer_a)
-        free(alac->uncompressed_bytes_buffer_a);
-    if (alac->uncompressed_bytes_buffer_b)
-        free(alac->uncompressed_bytes_buffer_b);
-
-    free(alac);
+    if (alac->arena_owned)
+        free(alac->arena);
+    if (alac->context_owned)
+        free(alac);
 }
 
 void alac_allocate_buffers(alac_file *alac)
 {
-    alac->predicterror_buffer_a = malloc(alac->setinfo_max_samples_per_frame * 4);
-    alac->predicterror_buffer_b = malloc(alac->setinfo_max_samples_per_frame * 4);
+    void *arena;
 
-    alac->outputsamples_buffer_a = malloc(alac->setinfo_max_samples_per_frame * 4);
-    alac->outputsamples_buffer_b = malloc(alac->setinfo_max_samples_per_frame * 4);
+    if (alac->arena_owned)
+        free(alac->arena);
+    alac->arena = NULL;
+    alac->arena_owned = 0;
 
-    alac->uncompressed_bytes_buffer_a = malloc(alac->setinfo_max_samples_per_frame * 4);
-    alac->uncompressed_bytes_buffer_b = malloc(alac->setinfo_max_samples_per_frame * 4);
+    if (posix_memalign(&arena, ALAC_ALIGN,
+                       alac_buffers_size(alac->numchannels,
+                                         alac->setinfo_max_samples_per_frame)))
+        return;
+
+    attach_buffers(alac, arena);
+    alac->arena_owned = 1;
+}
+
+alac_file *alac_init_context(void *mem, int samplesize, int numchannels,
+                             uint32_t max_samples_per_frame)
+{
+    alac_file *alac = mem;
+
+    init_context(alac, samplesize, numchannels);
+    alac->setinfo_max_samples_per_frame = max_samples_per_frame;
+    attach_buffers(alac, (unsigned char*)mem + ALIGN_UP(sizeof(alac_file)));
+
+    return alac;
 }
 
 void alac_set_info(alac_file *alac, char *inputbuffer)
@@ -135,86 +200,106 @@ void alac_set_info(alac_file *alac, char *inputbuffer)
 
 /* stream reading */
 
-/* supports reading 1 to 16 bits, in big endian format */
-static uint32_t readbits_16(alac_file *alac, int bits)
+/* the bitstream is read through a 64 bit cache ("reservoir") holding the
+ * next unread bits left-aligned. refilling loads a whole big endian word
+ * at once, so most fields are extracted with a couple of shifts and no
+ * memory access at all. the reader lives on the stack of
+ * alac_decode_frame so the compiler can keep it in registers.
+ *
+ * note: refills are unconditional on the hot paths, so they can happen
+ * while the cache is still nearly full. the cached bits always end at
+ * ptr, so with at most 63 of them ptr is at most 7 bytes past the last
+ * bit consumed, and a refill loads the 8 bytes from there: up to 15
+ * bytes past the end of a frame whose last bit has been consumed. hence
+ * ALAC_INPUT_PADDING is 16.
+ */
+typedef struct
 {
-    uint32_t result;
-    int new_accumulator;
-
-    result = (alac->input_buffer[0] << 16) |
-             (alac->input_buffer[1] << 8) |
-             (alac->input_buffer[2]);
+    const unsigned char *ptr; /* next byte not yet loaded into the cache */
+    uint64_t cache;           /* unread bits, msb first */
+    int bits;                 /* number of valid bits in the cache */
+} bitstream;
 
-    /* shift left by the number of bits we've already read,
-     * so that the top 'n' bits of the 24 bits we read will
-     * be the return bits */
-    result = result << alac->input_buffer_bitaccumulator;
-
-    result = result & 0x00ffffff;
-
-    /* and then only want the top 'n' bits from that, where
-     * n is 'bits' */
-    result = result >> (24 - bits);
+static inline uint64_t load_be64(const unsigned char *p)
+{
+#if defined(__GNUC__)
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return host_bigendian ? v : __builtin_bswap64(v);
+#else
+    return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+           ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+           ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+           ((uint64_t)p[6] << 8)  | ((uint64_t)p[7]);
+#endif
+}
 
-    new_accumulator = (alac->input_buffer_bitaccumulator + bits);
+static inline void bits_init(bitstream *bs, const unsigned char *buffer)
+{
+    bs->ptr = buffer;
+    bs->cache = 0;
+    bs->bits = 0;
+}
 
-    /* increase the buffer pointer if we've read over n bytes. */
-    alac->input_buffer += (new_accumulator >> 3);
+/* top the cache up to at least 56 valid bits. the bits below the valid
+ * ones are the true following bits of the stream, so ORing the next word
+ * in over them is harmless */
+static inline void bits_refill(bitstream *bs)
+{
+    bs->cache |= load_be64(bs->ptr) >> bs->bits;
+    bs->ptr += (63 - bs->bits) >> 3;
+    bs->bits |= 56;
+}
 
-    /* and the remainder goes back into the bit accumulator */
-    alac->input_buffer_bitaccumulator = (new_accumulator & 7);
+/* look at the next 1 to 32 bits without consuming them.
+ * the caller must make sure enough bits are cached */
+static inline uint32_t bits_peek(bitstream *bs, int bits)
+{
+    return (uint32_t)(bs->cache >> (64 - bits));
+}
 
-    return result;
+static inline void bits_skip(bitstream *bs, int bits)
+{
+    bs->cache <<= bits;
+    bs->bits -= bits;
 }
 
-/* supports reading 1 to 32 bits, in big endian format */
-static uint32_t readbits(alac_file *alac, int bits)
+/* skip to the next byte boundary */
+static inline void bits_align(bitstream *bs)
 {
-    int32_t result = 0;
+    bits_skip(bs, bs->bits & 7);
+}
 
-    if (bits > 16)
+/* skip any number of bits. the cached ones end at ptr, so past them the
+ * stream can be skipped by moving ptr */
+static inline void bits_advance(bitstream *bs, int bits)
+{
+    if (bits > bs->bits)
     {
-        bits -= 16;
-        result = readbits_16(alac, 16) << bits;
+        bits -= bs->bits;
+        bs->ptr += bits >> 3;
+        bs->cache = 0;
+        bs->bits = 0;
+        bits &= 7;
+        bits_refill(bs);
     }
-
-    result |= readbits_16(alac, bits);
-
-    return result;
+    bits_skip(bs, bits);
 }
 
-/* reads a single bit */
-static int readbit(alac_file *alac)
+/* supports reading 1 to 32 bits, in big endian format */
+static inline uint32_t readbits(bitstream *bs, int bits)
 {
-    int result;
-    int new_accumulator;
-
-    result = alac->input_buffer[0];
-
-    result = result << alac->input_buffer_bitaccumulator;
-
-    result = result >> 7 & 1;
-
-    new_accumulator = (alac->input_buffer_bitaccumulator + 1);
+    uint32_t result;
 
-    alac->input_buffer += (new_accumulator / 8);
+    if (bs->bits < bits)
+        bits_refill(bs);
 
-    alac->input_buffer_bitaccumulator = (new_accumulator % 8);
+    result = bits_peek(bs, bits);
+    bits_skip(bs, bits);
 
     return result;
 }
 
-static void unreadbits(alac_file *alac, int bits)
-{
-    int new_accumulator = (alac->input_buffer_bitaccumulator - bits);
-
-    alac->input_buffer += (new_accumulator >> 3);
-
-    alac->input_buffer_bitaccumulator = (new_accumulator & 7);
-    if (alac->input_buffer_bitaccumulator < 0)
-        alac->input_buffer_bitaccumulator *= -1;
-}
-
 /* various implementations of count_leading_zero:
  * the first one is the original one, the simplest and most
  * obvious for what it's doing. never use this.
@@ -308,15 +393,20 @@ found:
 
 #define RICE_THRESHOLD 8 // maximum number of bits for a rice prefix.
 
-static int32_t entropy_decode_value(alac_file* alac,
+#ifdef ALAC_REFERENCE_RICE
+/* the straightforward version, reading the prefix one bit at a time.
+ * kept as a reference for the one below */
+static int32_t entropy_decode_value(bitstream *bs,
                              int readSampleSize,
                              int k,
                              int rice_kmodifier_mask)
 {
     int32_t x = 0; // decoded value
 
+    bits_refill(bs);
+
     // read x, number of 1s before 0 represent the rice value.
-    while (x <= RICE_THRESHOLD && readbit(alac))
+    while (x <= RICE_THRESHOLD && readbits(bs, 1))
     {
         x++;
     }
@@ -326,7 +416,7 @@ static int32_t entropy_decode_value(alac_file* alac,
         // read the number from the bit stream (raw value)
         int32_t value;
 
-        value = readbits(alac, readSampleSize);
+        value = readbits(bs, readSampleSize);
 
         // mask value
         value &= (((uint32_t)0xffffffff) >> (32 - readSampleSize));
@@ -337,22 +427,89 @@ static int32_t entropy_decode_value(alac_file* alac,
     {
         if (k != 1)
         {
-            int extraBits = readbits(alac, k);
+            int extraBits;
+
+            if (bs->bits < k)
+                bits_refill(bs);
+            extraBits = bits_peek(bs, k);
 
             // x = x * (2^k - 1)
             x *= (((1 << k) - 1) & rice_kmodifier_mask);
 
+            /* a suffix of 0 or 1 is only k-1 bits long */
             if (extraBits > 1)
+            {
                 x += extraBits - 1;
+                bits_skip(bs, k);
+            }
             else
-                unreadbits(alac, 1);
+                bits_skip(bs, k - 1);
         }
     }
 
     return x;
 }
+#else
+static int32_t entropy_decode_value(bitstream *bs,
+                             int readSampleSize,
+                             int k,
+                             int rice_kmodifier_mask)
+{
+    int32_t x; // decoded value
+    uint32_t window;
+
+    bits_refill(bs);
+
+    // the prefix is a run of 1s terminated by a 0, or RICE_THRESHOLD+1
+    // 1s with no terminator. find its length with a single clz on the
+    // inverted window; the guard bit caps the count at RICE_THRESHOLD+1.
+    window = ~(uint32_t)(bs->cache >> 32) | (1 << (31 - (RICE_THRESHOLD + 1)));
+    x = count_leading_zeros(window);
 
-static void entropy_rice_decode(alac_file* alac,
+    if (x > RICE_THRESHOLD)
+    {
+        // read the number from the bit stream (raw value)
+        int32_t value;
+
+        bits_skip(bs, x);
+        value = readbits(bs, readSampleSize);
+
+        // mask value
+        value &= (((uint32_t)0xffffffff) >> (32 - readSampleSize));
+
+        x = value;
+    }
+    else
+    {
+        bits_skip(bs, x + 1);
+
+        if (k != 1)
+        {
+            int extraBits;
+
+            if (bs->bits < k)
+                bits_refill(bs);
+            extraBits = bits_peek(bs, k);
+
+            // x = x * (2^k - 1)
+            x *= (((1 << k) - 1) & rice_kmodifier_mask);
+
+            /* a suffix of 0 or 1 is only k-1 bits long */
+            if (extraBits > 1)
+            {
+                x += extraBits - 1;
+                bits_skip(bs, k);
+            }
+            else
+                bits_skip(bs, k - 1);
+        }
+    }
+
+    return x;
+}
+#endif
+
+static void entropy_rice_decode(bitstream *bs,
                          int32_t* outputBuffer,
                          int outputSize,
                          int readSampleSize,
@@ -377,7 +534,7 @@ static void entropy_rice_decode(alac_file* alac,
         else k = rice_kmodifier;
 
         // note: don't use rice_kmodifier_mask here (set mask to 0xFFFFFFFF)
-        decodedValue = entropy_decode_value(alac, readSampleSize, k, 0xFFFFFFFF);
+        decodedValue = entropy_decode_value(bs, readSampleSize, k, 0xFFFFFFFF);
 
         decodedValue += signModifier;
         finalValue = (decodedValue + 1) / 2; // inc by 1 and shift out sign bit
@@ -405,7 +562,7 @@ static void entropy_rice_decode(alac_file* alac,
             k = count_leading_zeros(history) + ((history + 16) / 64) - 24;
 
             // note: blockSize is always 16bit
-            blockSize = entropy_decode_value(alac, 16, k, rice_kmodifier_mask);
+            blockSize = entropy_decode_value(bs, 16, k, rice_kmodifier_mask);
 
             // got blockSize 0s
             if (blockSize > 0)
@@ -429,13 +586,108 @@ static void entropy_rice_decode(alac_file* alac,
                                 ((v > 0) ? (1) : \
                                            (0)))
 
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/* the general case below, for a number of taps known at compile time.
+ * every loop has a constant trip count so the compiler unrolls them and
+ * keeps the coefficients and the history window in registers instead of
+ * going back to memory for each sample.
+ */
+static ALWAYS_INLINE void predictor_fir_adapt_fixed(const int32_t *error_buffer,
+                                                   int32_t *buffer_out,
+                                                   int output_size,
+                                                   int readsamplesize,
+                                                   const int16_t *predictor_coef_table,
+                                                   const int ntaps,
+                                                   int predictor_quantitization)
+{
+    int16_t coef[32];
+    int32_t hist[33]; /* hist[0] is the oldest sample, hist[ntaps] the newest */
+    int i, j;
+
+    for (j = 0; j < ntaps; j++)
+        coef[j] = predictor_coef_table[j];
+    for (j = 0; j <= ntaps; j++)
+        hist[j] = buffer_out[j];
+
+    for (i = ntaps + 1; i < output_size; i++)
+    {
+        int32_t base = hist[0];
+        int32_t error_val = error_buffer[i];
+        int sum = 0;
+        int outval;
+
+        for (j = 0; j < ntaps; j++)
+            sum += (hist[ntaps - j] - base) * coef[j];
+
+        outval = (1 << (predictor_quantitization-1)) + sum;
+        outval = outval >> predictor_quantitization;
+        outval = outval + base + error_val;
+        outval = SIGN_EXTENDED32(outval, readsamplesize);
+
+        buffer_out[i] = outval;
+
+        if (error_val > 0)
+        {
+            for (j = ntaps - 1; j >= 0 && error_val > 0; j--)
+            {
+                int val = base - hist[ntaps - j];
+                int sign = SIGN_ONLY(val);
+
+                coef[j] -= sign;
+                val *= sign; /* absolute value */
+                error_val -= ((val >> predictor_quantitization) * (ntaps - j));
+            }
+        }
+        else if (error_val < 0)
+        {
+            for (j = ntaps - 1; j >= 0 && error_val < 0; j--)
+            {
+                int val = base - hist[ntaps - j];
+                int sign = - SIGN_ONLY(val);
+
+                coef[j] -= sign;
+                val *= sign; /* neg value */
+                error_val -= ((val >> predictor_quantitization) * (ntaps - j));
+            }
+        }
+
+        for (j = 0; j < ntaps; j++)
+            hist[j] = hist[j + 1];
+        hist[ntaps] = outval;
+    }
+}
+
+static void predictor_fir_adapt_4(const int32_t *error_buffer, int32_t *buffer_out,
+                                  int output_size, int readsamplesize,
+                                  const int16_t *predictor_coef_table,
+                                  int predictor_quantitization)
+{
+    predictor_fir_adapt_fixed(error_buffer, buffer_out, output_size, readsamplesize,
+                              predictor_coef_table, 4, predictor_quantitization);
+}
+
+static void predictor_fir_adapt_8(const int32_t *error_buffer, int32_t *buffer_out,
+                                  int output_size, int readsamplesize,
+                                  const int16_t *predictor_coef_table,
+                                  int predictor_quantitization)
+{
+    predictor_fir_adapt_fixed(error_buffer, buffer_out, output_size, readsamplesize,
+                              predictor_coef_table, 8, predictor_quantitization);
+}
+
 static void predictor_decompress_fir_adapt(int32_t *error_buffer,
                                            int32_t *buffer_out,
                                            int output_size,
                                            int readsamplesize,
                                            int16_t *predictor_coef_table,
                                            int predictor_coef_num,
-                                           int predictor_quantitization)
+                                           int predictor_quantitization,
+                                           int generic_only)
 {
     int i;
 
@@ -454,6 +706,16 @@ static void predictor_decompress_fir_adapt(int32_t *error_buffer,
        * error describes a small difference from the previous sample only
        */
         if (output_size <= 1) return;
+        if (!generic_only)
+        {
+            int32_t value = buffer_out[0];
+            for (i = 1; i < output_size; i++)
+            {
+                value = SIGN_EXTENDED32((value + error_buffer[i]), readsamplesize);
+                buffer_out[i] = value;
+            }
+            return;
+        }
         for (i = 0; i < output_size - 1; i++)
         {
             int32_t prev_value;
@@ -482,23 +744,22 @@ static void predictor_decompress_fir_adapt(int32_t *error_buffer,
         }
     }
 
-#if 0
-    /* 4 and 8 are very common cases (the only ones i've seen). these
-     * should be unrolled and optimised
+    /* 4 and 8 are very common cases (the only ones i've seen), so they
+     * get their own unrolled versions of the general case
      */
-    if (predictor_coef_num == 4)
+    if (!generic_only && predictor_coef_num == 4)
     {
-        /* FIXME: optimised general case */
+        predictor_fir_adapt_4(error_buffer, buffer_out, output_size, readsamplesize,
+                              predictor_coef_table, predictor_quantitization);
         return;
     }
 
-    if (predictor_coef_table == 8)
+    if (!generic_only && predictor_coef_num == 8)
     {
-        /* FIXME: optimised general case */
+        predictor_fir_adapt_8(error_buffer, buffer_out, output_size, readsamplesize,
+                              predictor_coef_table, predictor_quantitization);
         return;
     }
-#endif
-
 
     /* general case */
     if (predictor_coef_num > 0)
@@ -569,19 +830,270 @@ static void predictor_decompress_fir_adapt(int32_t *error_buffer,
     }
 }
 
+/* vectorised stereo deinterlacing. each routine handles as many samples
+ * as it can in whole vectors, writing interleaved little endian PCM,
+ * and returns how far it got; the scalar code finishes the frame.
+ */
+#if defined(ALAC_SSE2)
+#if defined(__SSE2__)
+#define SSE2_TARGET
+#else
+/* 32 bit x86 built without -msse2. only used if the CPU says it's there */
+#define SSE2_TARGET __attribute__((target("sse2")))
+#endif
+
+/* SSE2 has no 32 bit low multiply, so build one from two 32x32->64 */
+static SSE2_TARGET inline __m128i mullo_epi32_sse2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static SSE2_TARGET inline void unmix_sse2(const int32_t *buffer_a, const int32_t *buffer_b,
+                                          __m128i weight, __m128i shift,
+                                          uint8_t interlacing_leftweight,
+                                          __m128i *left, __m128i *right)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *)buffer_a);
+    __m128i b = _mm_loadu_si128((const __m128i *)buffer_b);
+
+    if (interlacing_leftweight)
+    {
+        *right = _mm_sub_epi32(a, _mm_sra_epi32(mullo_epi32_sse2(b, weight), shift));
+        *left = _mm_add_epi32(*right, b);
+    }
+    else
+    {
+        *left = a;
+        *right = b;
+    }
+}
+
+static SSE2_TARGET int deinterlace_16_sse2(int32_t *buffer_a, int32_t *buffer_b,
+                                           int16_t *buffer_out, int numsamples,
+                                           uint8_t interlacing_shift,
+                                           uint8_t interlacing_leftweight)
+{
+    const __m128i weight = _mm_set1_epi32(interlacing_leftweight);
+    const __m128i shift = _mm_cvtsi32_si128(interlacing_shift);
+    const __m128i low16 = _mm_set1_epi32(0xFFFF);
+    int i;
+
+    for (i = 0; i + 4 <= numsamples; i += 4)
+    {
+        __m128i left, right;
+
+        unmix_sse2(buffer_a + i, buffer_b + i, weight, shift,
+                   interlacing_leftweight, &left, &right);
+
+        /* each 32 bit lane becomes one little endian L,R pair */
+        _mm_storeu_si128((__m128i *)(buffer_out + i * 2),
+                         _mm_or_si128(_mm_and_si128(left, low16),
+                                      _mm_slli_epi32(right, 16)));
+    }
+
+    return i;
+}
+
+/* squeeze the two 24 bit samples in each 64 bit lane together */
+static SSE2_TARGET inline __m128i pack_24_sse2(__m128i v)
+{
+    const __m128i lo = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+    const __m128i hi = _mm_set_epi32(0x0000FFFF, 0xFF000000, 0x0000FFFF, 0xFF000000);
+    return _mm_or_si128(_mm_and_si128(v, lo),
+                        _mm_and_si128(_mm_srli_epi64(v, 8), hi));
+}
+
+static SSE2_TARGET int deinterlace_24_sse2(int32_t *buffer_a, int32_t *buffer_b,
+                                           int uncompressed_bytes,
+                                           int32_t *uncompressed_bytes_buffer_a,
+                                           int32_t *uncompressed_bytes_buffer_b,
+                                           uint8_t *buffer_out, int numsamples,
+                                           uint8_t interlacing_shift,
+                                           uint8_t interlacing_leftweight)
+{
+    const __m128i weight = _mm_set1_epi32(interlacing_leftweight);
+    const __m128i shift = _mm_cvtsi32_si128(interlacing_shift);
+    const __m128i ub_shift = _mm_cvtsi32_si128(uncompressed_bytes * 8);
+    const __m128i ub_mask = _mm_set1_epi32(~(0xFFFFFFFF << (uncompressed_bytes * 8)));
+    int i;
+
+    /* every store writes 2 bytes past the pair it holds, so stop while at
+     * least one more sample follows to absorb the last one */
+    for (i = 0; i + 4 < numsamples; i += 4)
+    {
+        __m128i left, right, pairs;
+        uint8_t *out = buffer_out + i * 6;
+
+        unmix_sse2(buffer_a + i, buffer_b + i, weight, shift,
+                   interlacing_leftweight, &left, &right);
+
+        if (uncompressed_bytes)
+        {
+            __m128i ua = _mm_loadu_si128((const __m128i *)(uncompressed_bytes_buffer_a + i));
+            __m128i ub = _mm_loadu_si128((const __m128i *)(uncompressed_bytes_buffer_b + i));
+            left = _mm_or_si128(_mm_sll_epi32(left, ub_shift), _mm_and_si128(ua, ub_mask));
+            right = _mm_or_si128(_mm_sll_epi32(right, ub_shift), _mm_and_si128(ub, ub_mask));
+        }
+
+        pairs = pack_24_sse2(_mm_unpacklo_epi32(left, right));
+        _mm_storel_epi64((__m128i *)out, pairs);
+        _mm_storel_epi64((__m128i *)(out + 6), _mm_unpackhi_epi64(pairs, pairs));
+
+        pairs = pack_24_sse2(_mm_unpackhi_epi32(left, right));
+        _mm_storel_epi64((__m128i *)(out + 12), pairs);
+        _mm_storel_epi64((__m128i *)(out + 18), _mm_unpackhi_epi64(pairs, pairs));
+    }
+
+    return i;
+}
+#endif /* ALAC_SSE2 */
+
+#if defined(ALAC_NEON)
+static inline void unmix_neon(const int32_t *buffer_a, const int32_t *buffer_b,
+                              int32x4_t weight, int32x4_t shift,
+                              uint8_t interlacing_leftweight,
+                              int32x4_t *left, int32x4_t *right)
+{
+    int32x4_t a = vld1q_s32(buffer_a);
+    int32x4_t b = vld1q_s32(buffer_b);
+
+    if (interlacing_leftweight)
+    {
+        /* a negative shift count shifts right, arithmetically */
+        *right = vsubq_s32(a, vshlq_s32(vmulq_s32(b, weight), shift));
+        *left = vaddq_s32(*right, b);
+    }
+    else
+    {
+        *left = a;
+        *right = b;
+    }
+}
+
+static int deinterlace_16_neon(int32_t *buffer_a, int32_t *buffer_b,
+                               int16_t *buffer_out, int numsamples,
+                               uint8_t interlacing_shift,
+                               uint8_t interlacing_leftweight)
+{
+    const int32x4_t weight = vdupq_n_s32(interlacing_leftweight);
+    const int32x4_t shift = vdupq_n_s32(-(int)interlacing_shift);
+    int i;
+
+    for (i = 0; i + 4 <= numsamples; i += 4)
+    {
+        int32x4_t left, right;
+        int16x4x2_t pairs;
+
+        unmix_neon(buffer_a + i, buffer_b + i, weight, shift,
+                   interlacing_leftweight, &left, &right);
+
+        pairs.val[0] = vmovn_s32(left);
+        pairs.val[1] = vmovn_s32(right);
+        vst2_s16(buffer_out + i * 2, pairs);
+    }
+
+    return i;
+}
+
+static int deinterlace_24_neon(int32_t *buffer_a, int32_t *buffer_b,
+                               int uncompressed_bytes,
+                               int32_t *uncompressed_bytes_buffer_a,
+                               int32_t *uncompressed_bytes_buffer_b,
+                               uint8_t *buffer_out, int numsamples,
+                               uint8_t interlacing_shift,
+                               uint8_t interlacing_leftweight)
+{
+    const int32x4_t weight = vdupq_n_s32(interlacing_leftweight);
+    const int32x4_t shift = vdupq_n_s32(-(int)interlacing_shift);
+    const int32x4_t ub_shift = vdupq_n_s32(uncompressed_bytes * 8);
+    const int32x4_t ub_mask = vdupq_n_s32(~(0xFFFFFFFF << (uncompressed_bytes * 8)));
+    int i;
+
+    for (i = 0; i + 4 <= numsamples; i += 4)
+    {
+        int32x4_t left, right;
+        int32x4x2_t pairs;
+        uint32x4_t lo, hi;
+        uint16x8_t low16;
+        uint8x8x3_t bytes;
+
+        unmix_neon(buffer_a + i, buffer_b + i, weight, shift,
+                   interlacing_leftweight, &left, &right);
+
+        if (uncompressed_bytes)
+        {
+            int32x4_t ua = vld1q_s32(uncompressed_bytes_buffer_a + i);
+            int32x4_t ub = vld1q_s32(uncompressed_bytes_buffer_b + i);
+            left = vorrq_s32(vshlq_s32(left, ub_shift), vandq_s32(ua, ub_mask));
+            right = vorrq_s32(vshlq_s32(right, ub_shift), vandq_s32(ub, ub_mask));
+        }
+
+        /* L0 R0 L1 R1, L2 R2 L3 R3, then split into byte planes and
+         * let vst3 interleave them back as packed 24 bit */
+        pairs = vzipq_s32(left, right);
+        lo = vreinterpretq_u32_s32(pairs.val[0]);
+        hi = vreinterpretq_u32_s32(pairs.val[1]);
+        low16 = vcombine_u16(vmovn_u32(lo), vmovn_u32(hi));
+        bytes.val[0] = vmovn_u16(low16);
+        bytes.val[1] = vshrn_n_u16(low16, 8);
+        bytes.val[2] = vmovn_u16(vcombine_u16(vshrn_n_u32(lo, 16), vshrn_n_u32(hi, 16)));
+        vst3_u8(buffer_out + i * 6, bytes);
+    }
+
+    return i;
+}
+#endif /* ALAC_NEON */
+
+/* whether the vectorised code can be used on this CPU */
+static int simd_supported(void)
+{
+    if (host_bigendian)
+        return 0;
+#if defined(ALAC_SSE2) && defined(__SSE2__)
+    return 1;
+#elif defined(ALAC_SSE2)
+    static int supported = -1;
+    if (supported < 0)
+    {
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("sse2");
+    }
+    return supported;
+#elif defined(ALAC_NEON)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
 static void deinterlace_16(int32_t *buffer_a, int32_t *buffer_b,
                     int16_t *buffer_out,
                     int numchannels, int numsamples,
                     uint8_t interlacing_shift,
-                    uint8_t interlacing_leftweight)
+                    uint8_t interlacing_leftweight,
+                    int use_simd)
 {
-    int i;
+    int i = 0;
     if (numsamples <= 0) return;
 
+    if (use_simd && numchannels == 2)
+    {
+#if defined(ALAC_SSE2)
+        i = deinterlace_16_sse2(buffer_a, buffer_b, buffer_out, numsamples,
+                                interlacing_shift, interlacing_leftweight);
+#elif defined(ALAC_NEON)
+        i = deinterlace_16_neon(buffer_a, buffer_b, buffer_out, numsamples,
+                                interlacing_shift, interlacing_leftweight);
+#endif
+    }
+
     /* weighted interlacing */
     if (interlacing_leftweight)
     {
-        for (i = 0; i < numsamples; i++)
+        for (; i < numsamples; i++)
         {
             int32_t difference, midright;
             int16_t left;
@@ -609,7 +1121,7 @@ static void deinterlace_16(int32_t *buffer_a, int32_t *buffer_b,
     }
 
     /* otherwise basic interlacing took place */
-    for (i = 0; i < numsamples; i++)
+    for (; i < numsamples; i++)
     {
         int16_t left, right;
 
@@ -634,15 +1146,31 @@ static void deinterlace_24(int32_t *buffer_a, int32_t *buffer_b,
                     void *buffer_out,
                     int numchannels, int numsamples,
                     uint8_t interlacing_shift,
-                    uint8_t interlacing_leftweight)
+                    uint8_t interlacing_leftweight,
+                    int use_simd)
 {
-    int i;
+    int i = 0;
     if (numsamples <= 0) return;
 
+    if (use_simd && numchannels == 2)
+    {
+#if defined(ALAC_SSE2)
+        i = deinterlace_24_sse2(buffer_a, buffer_b, uncompressed_bytes,
+                                uncompressed_bytes_buffer_a, uncompressed_bytes_buffer_b,
+                                buffer_out, numsamples,
+                                interlacing_shift, interlacing_leftweight);
+#elif defined(ALAC_NEON)
+        i = deinterlace_24_neon(buffer_a, buffer_b, uncompressed_bytes,
+                                uncompressed_bytes_buffer_a, uncompressed_bytes_buffer_b,
+                                buffer_out, numsamples,
+                                interlacing_shift, interlacing_leftweight);
+#endif
+    }
+
     /* weighted interlacing */
     if (interlacing_leftweight)
     {
-        for (i = 0; i < numsamples; i++)
+        for (; i < numsamples; i++)
         {
             int32_t difference, midright;
             int32_t left;
@@ -677,7 +1205,7 @@ static void deinterlace_24(int32_t *buffer_a, int32_t *buffer_b,
     }
 
     /* otherwise basic interlacing took place */
-    for (i = 0; i < numsamples; i++)
+    for (; i < numsamples; i++)
     {
         int32_t left, right;
 
@@ -706,433 +1234,812 @@ static void deinterlace_24(int32_t *buffer_a, int32_t *buffer_b,
 
 }
 
-void alac_decode_frame(alac_file *alac,
-                       unsigned char *inbuffer,
-                       void *outbuffer, int *outputsize)
+/* the alternative output formats (see alac_set_output). these unmix
+ * the channels, convert to the wanted format and apply the gain in the
+ * same pass, so each sample is written exactly once.
+ */
+static inline int unity_gain(alac_file *alac)
 {
-    int channels;
-    int32_t outputsamples = alac->setinfo_max_samples_per_frame;
+    return !alac->output_step && alac->output_gain == (int64_t)0x10000 << 16;
+}
 
-    /* setup the stream */
-    alac->input_buffer = inbuffer;
-    alac->input_buffer_bitaccumulator = 0;
+/* S16 from a 16 bit stream at unity gain is just the native output,
+ * which has vector code */
+static inline int convert_output(alac_file *alac)
+{
+    if (alac->output_format == ALAC_OUTPUT_NATIVE)
+        return 0;
+    return !(alac->output_format == ALAC_OUTPUT_S16 &&
+             alac->setinfo_sample_size == 16 && unity_gain(alac));
+}
 
-    channels = readbits(alac, 3);
+/* TPDF noise of +-1 LSB of the 16 bit output, on the scale of a 32 bit
+ * sample times a 16.16 gain */
+static inline int64_t tpdf_dither(alac_file *alac)
+{
+    uint32_t r = alac->dither_state;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    alac->dither_state = r;
+    return ((int64_t)(r & 0xffff) - (int64_t)(r >> 16)) << 16;
+}
 
-    *outputsize = outputsamples * alac->bytespersample;
+static inline void unmix_sample(int32_t *buffer_a, int32_t *buffer_b, int i,
+                                int uncompressed_bytes,
+                                int32_t *uncompressed_bytes_buffer_a,
+                                int32_t *uncompressed_bytes_buffer_b,
+                                uint8_t interlacing_shift,
+                                uint8_t interlacing_leftweight,
+                                int32_t *left, int32_t *right)
+{
+    if (!buffer_b)
+    {
+        *left = buffer_a[i];
+        *right = 0;
+    }
+    else if (interlacing_leftweight)
+    {
+        *right = buffer_a[i] - ((buffer_b[i] * interlacing_leftweight) >> interlacing_shift);
+        *left = *right + buffer_b[i];
+    }
+    else
+    {
+        *left = buffer_a[i];
+        *right = buffer_b[i];
+    }
 
-    switch(channels)
+    if (uncompressed_bytes)
     {
-    case 0: /* 1 channel */
+        uint32_t mask = ~(0xFFFFFFFF << (uncompressed_bytes * 8));
+        *left = (*left << (uncompressed_bytes * 8)) | (uncompressed_bytes_buffer_a[i] & mask);
+        if (buffer_b)
+            *right = (*right << (uncompressed_bytes * 8)) | (uncompressed_bytes_buffer_b[i] & mask);
+    }
+}
+
+/* buffer_b is NULL for a mono frame */
+static void deinterlace_convert(alac_file *alac,
+                                int32_t *buffer_a, int32_t *buffer_b,
+                                int uncompressed_bytes,
+                                int32_t *uncompressed_bytes_buffer_a,
+                                int32_t *uncompressed_bytes_buffer_b,
+                                void *buffer_out, int numsamples,
+                                uint8_t interlacing_shift,
+                                uint8_t interlacing_leftweight)
+{
+    int numchannels = alac->numchannels;
+    int channels = buffer_b ? 2 : 1;
+    /* shift that puts the top bit of a sample at bit 31 */
+    int align = 32 - alac->setinfo_sample_size;
+    /* every element of a frame starts from the frame's gain */
+    int64_t gain = alac->output_gain;
+    int i, c;
+
+    for (i = 0; i < numsamples; i++, gain += alac->output_step)
     {
-        int hassize;
-        int isnotcompressed;
-        int readsamplesize;
+        int32_t sample[2];
+        int32_t g = gain < 0 ? 0 : gain >> 16;
 
-        int uncompressed_bytes;
-        int ricemodifier;
+        unmix_sample(buffer_a, buffer_b, i, uncompressed_bytes,
+                     uncompressed_bytes_buffer_a, uncompressed_bytes_buffer_b,
+                     interlacing_shift, interlacing_leftweight,
+                     &sample[0], &sample[1]);
 
-        /* 2^result = something to do with output waiting.
-         * perhaps matters if we read > 1 frame in a pass?
-         */
-        readbits(alac, 4);
+        for (c = 0; c < channels; c++)
+        {
+            int32_t aligned = (int32_t)((uint32_t)sample[c] << align);
 
-        readbits(alac, 12); /* unknown, skip 12 bits */
+            if (alac->output_format == ALAC_OUTPUT_S16)
+            {
+                int64_t out = aligned >> 16;
+                /* as the player's volume does, a gain over unity is unity.
+                 * the dither can push a full scale sample over the top */
+                if (g < 0x10000)
+                {
+                    out = ((int64_t)aligned * g + tpdf_dither(alac) +
+                           0x80000000LL) >> 32;
+                    if (out > 32767)
+                        out = 32767;
+                }
+                ((int16_t*)buffer_out)[i * numchannels + c] = out;
+            }
+            else
+            {
+                if (g != 0x10000)
+                    aligned = ((int64_t)aligned * g) >> 16;
+                ((int32_t*)buffer_out)[i * numchannels + c] = aligned;
+            }
+        }
+    }
+}
 
-        hassize = readbits(alac, 1); /* the output sample size is stored soon */
+/* native output for 20 and 32 bit streams: packed little endian, with
+ * 20 bit samples msb aligned in 24 bit containers as Apple's decoder
+ * does. buffer_b is NULL for a mono frame */
+static void deinterlace_packed(alac_file *alac,
+                               int32_t *buffer_a, int32_t *buffer_b,
+                               int uncompressed_bytes,
+                               int32_t *uncompressed_bytes_buffer_a,
+                               int32_t *uncompressed_bytes_buffer_b,
+                               void *buffer_out, int numsamples,
+                               uint8_t interlacing_shift,
+                               uint8_t interlacing_leftweight)
+{
+    int numchannels = alac->numchannels;
+    int channels = buffer_b ? 2 : 1;
+    int bytes = (alac->setinfo_sample_size + 7) / 8;
+    int align = bytes * 8 - alac->setinfo_sample_size;
+    uint8_t *out = buffer_out;
+    int i, c, b;
 
-        uncompressed_bytes = readbits(alac, 2); /* number of bytes in the (compressed) stream that are not compressed */
+    for (i = 0; i < numsamples; i++)
+    {
+        int32_t sample[2];
 
-        isnotcompressed = readbits(alac, 1); /* whether the frame is compressed */
+        unmix_sample(buffer_a, buffer_b, i, uncompressed_bytes,
+                     uncompressed_bytes_buffer_a, uncompressed_bytes_buffer_b,
+                     interlacing_shift, interlacing_leftweight,
+                     &sample[0], &sample[1]);
 
-        if (hassize)
+        for (c = 0; c < channels; c++)
         {
-            /* now read the number of samples,
-             * as a 32bit integer */
-            outputsamples = readbits(alac, 32);
-            *outputsize = outputsamples * alac->bytespersample;
+            uint32_t v = (uint32_t)sample[c] << align;
+            uint8_t *p = out + (i * numchannels + c) * bytes;
+            for (b = 0; b < bytes; b++)
+                p[b] = v >> (b * 8);
         }
+    }
+}
 
-        readsamplesize = alac->setinfo_sample_size - (uncompressed_bytes * 8);
+/* a single channel element, decoded into output channel 'channel'.
+ * returns the number of samples in the frame */
+static int32_t decode_sce(alac_file *alac, bitstream *bs, int channel,
+                          void *buffer_out, int32_t outputsamples)
+{
+    int32_t *predicterror_buffer_a = alac->predicterror_buffer[channel];
+    int32_t *outputsamples_buffer_a = alac->outputsamples_buffer[channel];
+    int32_t *uncompressed_bytes_buffer_a = alac->uncompressed_bytes_buffer[channel];
 
-        if (!isnotcompressed)
-        { /* so it is compressed */
-            int16_t predictor_coef_table[32];
-            int predictor_coef_num;
-            int prediction_type;
-            int prediction_quantitization;
-            int i;
+    int hassize;
+    int isnotcompressed;
+    int readsamplesize;
 
-            /* skip 16 bits, not sure what they are. seem to be used in
-             * two channel case */
-            readbits(alac, 8);
-            readbits(alac, 8);
+    int uncompressed_bytes;
+    int ricemodifier;
 
-            prediction_type = readbits(alac, 4);
-            prediction_quantitization = readbits(alac, 4);
+    /* 2^result = something to do with output waiting.
+     * perhaps matters if we read > 1 frame in a pass?
+     */
+    readbits(bs, 4);
 
-            ricemodifier = readbits(alac, 3);
-            predictor_coef_num = readbits(alac, 5);
+    readbits(bs, 12); /* unknown, skip 12 bits */
 
-            /* read the predictor table */
-            for (i = 0; i < predictor_coef_num; i++)
-            {
-                predictor_coef_table[i] = (int16_t)readbits(alac, 16);
-            }
+    hassize = readbits(bs, 1); /* the output sample size is stored soon */
 
-            if (uncompressed_bytes)
-            {
-                int i;
-                for (i = 0; i < outputsamples; i++)
-                {
-                    alac->uncompressed_bytes_buffer_a[i] = readbits(alac, uncompressed_bytes * 8);
-                }
-            }
+    uncompressed_bytes = readbits(bs, 2); /* number of bytes in the (compressed) stream that are not compressed */
 
-            entropy_rice_decode(alac,
-                                alac->predicterror_buffer_a,
-                                outputsamples,
-                                readsamplesize,
-                                alac->setinfo_rice_initialhistory,
-                                alac->setinfo_rice_kmodifier,
-                                ricemodifier * alac->setinfo_rice_historymult / 4,
-                                (1 << alac->setinfo_rice_kmodifier) - 1);
-
-            if (prediction_type == 0)
-            { /* adaptive fir */
-                predictor_decompress_fir_adapt(alac->predicterror_buffer_a,
-                                               alac->outputsamples_buffer_a,
-                                               outputsamples,
-                                               readsamplesize,
-                                               predictor_coef_table,
-                                               predictor_coef_num,
-                                               prediction_quantitization);
-            }
-            else
-            {
-                fprintf(stderr, "FIXME: unhandled predicition type: %i\n", prediction_type);
-                /* i think the only other prediction type (or perhaps this is just a
-                 * boolean?) runs adaptive fir twice.. like:
-                 * predictor_decompress_fir_adapt(predictor_error, tempout, ...)
-                 * predictor_decompress_fir_adapt(predictor_error, outputsamples ...)
-                 * little strange..
-                 */
-            }
+    isnotcompressed = readbits(bs, 1); /* whether the frame is compressed */
 
-        }
-        else
-        { /* not compressed, easy case */
-            if (alac->setinfo_sample_size <= 16)
-            {
-                int i;
-                for (i = 0; i < outputsamples; i++)
-                {
-                    int32_t audiobits = readbits(alac, alac->setinfo_sample_size);
+    if (hassize)
+    {
+        /* now read the number of samples,
+         * as a 32bit integer */
+        outputsamples = readbits(bs, 32);
+    }
 
-                    audiobits = SIGN_EXTENDED32(audiobits, alac->setinfo_sample_size);
+    readsamplesize = alac->setinfo_sample_size - (uncompressed_bytes * 8);
 
-                    alac->outputsamples_buffer_a[i] = audiobits;
-                }
-            }
-            else
-            {
-                int i;
-                for (i = 0; i < outputsamples; i++)
-                {
-                    int32_t audiobits;
+    if (!isnotcompressed)
+    { /* so it is compressed */
+        int16_t predictor_coef_table[32];
+        int predictor_coef_num;
+        int prediction_type;
+        int prediction_quantitization;
+        int i;
 
-                    audiobits = readbits(alac, 16);
-                    /* special case of sign extension..
-                     * as we'll be ORing the low 16bits into this */
-                    audiobits = audiobits << (alac->setinfo_sample_size - 16);
-                    audiobits |= readbits(alac, alac->setinfo_sample_size - 16);
-                    audiobits = SignExtend24(audiobits);
+        /* skip 16 bits, not sure what they are. seem to be used in
+         * two channel case */
+        readbits(bs, 8);
+        readbits(bs, 8);
 
-                    alac->outputsamples_buffer_a[i] = audiobits;
-                }
+        prediction_type = readbits(bs, 4);
+        prediction_quantitization = readbits(bs, 4);
+
+        ricemodifier = readbits(bs, 3);
+        predictor_coef_num = readbits(bs, 5);
+
+        /* read the predictor table */
+        for (i = 0; i < predictor_coef_num; i++)
+        {
+            predictor_coef_table[i] = (int16_t)readbits(bs, 16);
+        }
+
+        if (uncompressed_bytes)
+        {
+            int i;
+            for (i = 0; i < outputsamples; i++)
+            {
+                uncompressed_bytes_buffer_a[i] = readbits(bs, uncompressed_bytes * 8);
             }
-            uncompressed_bytes = 0; // always 0 for uncompressed
         }
 
-        switch(alac->setinfo_sample_size)
+        entropy_rice_decode(bs,
+                            predicterror_buffer_a,
+                            outputsamples,
+                            readsamplesize,
+                            alac->setinfo_rice_initialhistory,
+                            alac->setinfo_rice_kmodifier,
+                            ricemodifier * alac->setinfo_rice_historymult / 4,
+                            (1 << alac->setinfo_rice_kmodifier) - 1);
+
+        if (prediction_type == 0)
+        { /* adaptive fir */
+            predictor_decompress_fir_adapt(predicterror_buffer_a,
+                                           outputsamples_buffer_a,
+                                           outputsamples,
+                                           readsamplesize,
+                                           predictor_coef_table,
+                                           predictor_coef_num,
+                                           prediction_quantitization,
+                                           alac->generic_predictors);
+        }
+        else
         {
-        case 16:
+            fprintf(stderr, "FIXME: unhandled predicition type: %i\n", prediction_type);
+            /* i think the only other prediction type (or perhaps this is just a
+             * boolean?) runs adaptive fir twice.. like:
+             * predictor_decompress_fir_adapt(predictor_error, tempout, ...)
+             * predictor_decompress_fir_adapt(predictor_error, outputsamples ...)
+             * little strange..
+             */
+        }
+
+    }
+    else
+    { /* not compressed, easy case */
+        if (alac->setinfo_sample_size <= 16)
         {
             int i;
             for (i = 0; i < outputsamples; i++)
             {
-                int16_t sample = alac->outputsamples_buffer_a[i];
-                if (host_bigendian)
-                    _Swap16(sample);
-                ((int16_t*)outbuffer)[i * alac->numchannels] = sample;
+                int32_t audiobits = readbits(bs, alac->setinfo_sample_size);
+
+                audiobits = SIGN_EXTENDED32(audiobits, alac->setinfo_sample_size);
+
+                outputsamples_buffer_a[i] = audiobits;
             }
-            break;
         }
-        case 24:
+        else
         {
             int i;
             for (i = 0; i < outputsamples; i++)
             {
-                int32_t sample = alac->outputsamples_buffer_a[i];
+                uint32_t audiobits;
 
-                if (uncompressed_bytes)
-                {
-                    uint32_t mask;
-                    sample = sample << (uncompressed_bytes * 8);
-                    mask = ~(0xFFFFFFFF << (uncompressed_bytes * 8));
-                    sample |= alac->uncompressed_bytes_buffer_a[i] & mask;
-                }
+                audiobits = readbits(bs, 16);
+                /* special case of sign extension..
+                 * as we'll be ORing the low bits into this */
+                audiobits = audiobits << (alac->setinfo_sample_size - 16);
+                audiobits |= readbits(bs, alac->setinfo_sample_size - 16);
+                audiobits = (int32_t)(audiobits << (32 - alac->setinfo_sample_size)) >> (32 - alac->setinfo_sample_size);
 
-                ((uint8_t*)outbuffer)[i * alac->numchannels * 3] = (sample) & 0xFF;
-                ((uint8_t*)outbuffer)[i * alac->numchannels * 3 + 1] = (sample >> 8) & 0xFF;
-                ((uint8_t*)outbuffer)[i * alac->numchannels * 3 + 2] = (sample >> 16) & 0xFF;
+                outputsamples_buffer_a[i] = audiobits;
             }
-            break;
         }
-        case 20:
-        case 32:
-            fprintf(stderr, "FIXME: unimplemented sample size %i\n", alac->setinfo_sample_size);
-            break;
-        default:
-            break;
+        uncompressed_bytes = 0; // always 0 for uncompressed
+    }
+
+    if (convert_output(alac))
+    {
+        deinterlace_convert(alac,
+                            outputsamples_buffer_a, NULL,
+                            uncompressed_bytes,
+                            uncompressed_bytes_buffer_a, NULL,
+                            buffer_out,
+                            outputsamples,
+                            0, 0);
+        return outputsamples;
+    }
+
+    switch(alac->setinfo_sample_size)
+    {
+    case 16:
+    {
+        int i;
+        for (i = 0; i < outputsamples; i++)
+        {
+            int16_t sample = outputsamples_buffer_a[i];
+            if (host_bigendian)
+                _Swap16(sample);
+            ((int16_t*)buffer_out)[i * alac->numchannels] = sample;
         }
         break;
     }
-    case 1: /* 2 channels */
+    case 24:
     {
-        int hassize;
-        int isnotcompressed;
-        int readsamplesize;
+        int i;
+        for (i = 0; i < outputsamples; i++)
+        {
+            int32_t sample = outputsamples_buffer_a[i];
+
+            if (uncompressed_bytes)
+            {
+                uint32_t mask;
+                sample = sample << (uncompressed_bytes * 8);
+                mask = ~(0xFFFFFFFF << (uncompressed_bytes * 8));
+                sample |= uncompressed_bytes_buffer_a[i] & mask;
+            }
+
+            ((uint8_t*)buffer_out)[i * alac->numchannels * 3] = (sample) & 0xFF;
+            ((uint8_t*)buffer_out)[i * alac->numchannels * 3 + 1] = (sample >> 8) & 0xFF;
+            ((uint8_t*)buffer_out)[i * alac->numchannels * 3 + 2] = (sample >> 16) & 0xFF;
+        }
+        break;
+    }
+    case 20:
+    case 32:
+        deinterlace_packed(alac,
+                           outputsamples_buffer_a, NULL,
+                           uncompressed_bytes,
+                           uncompressed_bytes_buffer_a, NULL,
+                           buffer_out,
+                           outputsamples,
+                           0, 0);
+        break;
+    default:
+        break;
+    }
+    return outputsamples;
+}
 
-        int uncompressed_bytes;
+/* a channel pair element, decoded into output channels 'channel' and
+ * 'channel' + 1. returns the number of samples in the frame */
+static int32_t decode_cpe(alac_file *alac, bitstream *bs, int channel,
+                          void *buffer_out, int32_t outputsamples, int use_simd)
+{
+    int32_t *predicterror_buffer_a = alac->predicterror_buffer[channel];
+    int32_t *predicterror_buffer_b = alac->predicterror_buffer[channel + 1];
+    int32_t *outputsamples_buffer_a = alac->outputsamples_buffer[channel];
+    int32_t *outputsamples_buffer_b = alac->outputsamples_buffer[channel + 1];
+    int32_t *uncompressed_bytes_buffer_a = alac->uncompressed_bytes_buffer[channel];
+    int32_t *uncompressed_bytes_buffer_b = alac->uncompressed_bytes_buffer[channel + 1];
 
-        uint8_t interlacing_shift;
-        uint8_t interlacing_leftweight;
+    int hassize;
+    int isnotcompressed;
+    int readsamplesize;
 
-        /* 2^result = something to do with output waiting.
-         * perhaps matters if we read > 1 frame in a pass?
-         */
-        readbits(alac, 4);
+    int uncompressed_bytes;
 
-        readbits(alac, 12); /* unknown, skip 12 bits */
+    uint8_t interlacing_shift;
+    uint8_t interlacing_leftweight;
 
-        hassize = readbits(alac, 1); /* the output sample size is stored soon */
+    /* 2^result = something to do with output waiting.
+     * perhaps matters if we read > 1 frame in a pass?
+     */
+    readbits(bs, 4);
 
-        uncompressed_bytes = readbits(alac, 2); /* the number of bytes in the (compressed) stream that are not compressed */
+    readbits(bs, 12); /* unknown, skip 12 bits */
 
-        isnotcompressed = readbits(alac, 1); /* whether the frame is compressed */
+    hassize = readbits(bs, 1); /* the output sample size is stored soon */
 
-        if (hassize)
-        {
-            /* now read the number of samples,
-             * as a 32bit integer */
-            outputsamples = readbits(alac, 32);
-            *outputsize = outputsamples * alac->bytespersample;
-        }
+    uncompressed_bytes = readbits(bs, 2); /* the number of bytes in the (compressed) stream that are not compressed */
 
-        readsamplesize = alac->setinfo_sample_size - (uncompressed_bytes * 8) + 1;
+    isnotcompressed = readbits(bs, 1); /* whether the frame is compressed */
 
-        if (!isnotcompressed)
-        { /* compressed */
-            int16_t predictor_coef_table_a[32];
-            int predictor_coef_num_a;
-            int prediction_type_a;
-            int prediction_quantitization_a;
-            int ricemodifier_a;
+    if (hassize)
+    {
+        /* now read the number of samples,
+         * as a 32bit integer */
+        outputsamples = readbits(bs, 32);
+    }
 
-            int16_t predictor_coef_table_b[32];
-            int predictor_coef_num_b;
-            int prediction_type_b;
-            int prediction_quantitization_b;
-            int ricemodifier_b;
+    readsamplesize = alac->setinfo_sample_size - (uncompressed_bytes * 8) + 1;
 
-            int i;
+    /* the extra bit is for the difference channel, so a 32 bit pair
+     * needs some bytes left uncompressed to fit the predictors */
+    if (!isnotcompressed && readsamplesize > 32)
+    {
+        fprintf(stderr, "FIXME: unhandled sample size: %i\n", readsamplesize);
+        return -1;
+    }
 
-            interlacing_shift = readbits(alac, 8);
-            interlacing_leftweight = readbits(alac, 8);
+    if (!isnotcompressed)
+    { /* compressed */
+        int16_t predictor_coef_table_a[32];
+        int predictor_coef_num_a;
+        int prediction_type_a;
+        int prediction_quantitization_a;
+        int ricemodifier_a;
 
-            /******** channel 1 ***********/
-            prediction_type_a = readbits(alac, 4);
-            prediction_quantitization_a = readbits(alac, 4);
+        int16_t predictor_coef_table_b[32];
+        int predictor_coef_num_b;
+        int prediction_type_b;
+        int prediction_quantitization_b;
+        int ricemodifier_b;
 
-            ricemodifier_a = readbits(alac, 3);
-            predictor_coef_num_a = readbits(alac, 5);
+        int i;
 
-            /* read the predictor table */
-            for (i = 0; i < predictor_coef_num_a; i++)
-            {
-                predictor_coef_table_a[i] = (int16_t)readbits(alac, 16);
-            }
+        interlacing_shift = readbits(bs, 8);
+        interlacing_leftweight = readbits(bs, 8);
 
-            /******** channel 2 *********/
-            prediction_type_b = readbits(alac, 4);
-            prediction_quantitization_b = readbits(alac, 4);
+        /******** channel 1 ***********/
+        prediction_type_a = readbits(bs, 4);
+        prediction_quantitization_a = readbits(bs, 4);
 
-            ricemodifier_b = readbits(alac, 3);
-            predictor_coef_num_b = readbits(alac, 5);
+        ricemodifier_a = readbits(bs, 3);
+        predictor_coef_num_a = readbits(bs, 5);
 
-            /* read the predictor table */
-            for (i = 0; i < predictor_coef_num_b; i++)
-            {
-                predictor_coef_table_b[i] = (int16_t)readbits(alac, 16);
-            }
+        /* read the predictor table */
+        for (i = 0; i < predictor_coef_num_a; i++)
+        {
+            predictor_coef_table_a[i] = (int16_t)readbits(bs, 16);
+        }
 
-            /*********************/
-            if (uncompressed_bytes)
-            { /* see mono case */
-                int i;
-                for (i = 0; i < outputsamples; i++)
-                {
-                    alac->uncompressed_bytes_buffer_a[i] = readbits(alac, uncompressed_bytes * 8);
-                    alac->uncompressed_bytes_buffer_b[i] = readbits(alac, uncompressed_bytes * 8);
-                }
-            }
+        /******** channel 2 *********/
+        prediction_type_b = readbits(bs, 4);
+        prediction_quantitization_b = readbits(bs, 4);
 
-            /* channel 1 */
-            entropy_rice_decode(alac,
-                                alac->predicterror_buffer_a,
-                                outputsamples,
-                                readsamplesize,
-                                alac->setinfo_rice_initialhistory,
-                                alac->setinfo_rice_kmodifier,
-                                ricemodifier_a * alac->setinfo_rice_historymult / 4,
-                                (1 << alac->setinfo_rice_kmodifier) - 1);
-
-            if (prediction_type_a == 0)
-            { /* adaptive fir */
-                predictor_decompress_fir_adapt(alac->predicterror_buffer_a,
-                                               alac->outputsamples_buffer_a,
-                                               outputsamples,
-                                               readsamplesize,
-                                               predictor_coef_table_a,
-                                               predictor_coef_num_a,
-                                               prediction_quantitization_a);
-            }
-            else
-            { /* see mono case */
-                fprintf(stderr, "FIXME: unhandled predicition type: %i\n", prediction_type_a);
-            }
+        ricemodifier_b = readbits(bs, 3);
+        predictor_coef_num_b = readbits(bs, 5);
 
-            /* channel 2 */
-            entropy_rice_decode(alac,
-                                alac->predicterror_buffer_b,
-                                outputsamples,
-                                readsamplesize,
-                                alac->setinfo_rice_initialhistory,
-                                alac->setinfo_rice_kmodifier,
-                                ricemodifier_b * alac->setinfo_rice_historymult / 4,
-                                (1 << alac->setinfo_rice_kmodifier) - 1);
-
-            if (prediction_type_b == 0)
-            { /* adaptive fir */
-                predictor_decompress_fir_adapt(alac->predicterror_buffer_b,
-                                               alac->outputsamples_buffer_b,
-                                               outputsamples,
-                                               readsamplesize,
-                                               predictor_coef_table_b,
-                                               predictor_coef_num_b,
-                                               prediction_quantitization_b);
-            }
-            else
+        /* read the predictor table */
+        for (i = 0; i < predictor_coef_num_b; i++)
+        {
+            predictor_coef_table_b[i] = (int16_t)readbits(bs, 16);
+        }
+
+        /*********************/
+        if (uncompressed_bytes)
+        { /* see mono case */
+            int i;
+            for (i = 0; i < outputsamples; i++)
             {
-                fprintf(stderr, "FIXME: unhandled predicition type: %i\n", prediction_type_b);
+                uncompressed_bytes_buffer_a[i] = readbits(bs, uncompressed_bytes * 8);
+                uncompressed_bytes_buffer_b[i] = readbits(bs, uncompressed_bytes * 8);
             }
         }
+
+        /* channel 1 */
+        entropy_rice_decode(bs,
+                            predicterror_buffer_a,
+                            outputsamples,
+                            readsamplesize,
+                            alac->setinfo_rice_initialhistory,
+                            alac->setinfo_rice_kmodifier,
+                            ricemodifier_a * alac->setinfo_rice_historymult / 4,
+                            (1 << alac->setinfo_rice_kmodifier) - 1);
+
+        if (prediction_type_a == 0)
+        { /* adaptive fir */
+            predictor_decompress_fir_adapt(predicterror_buffer_a,
+                                           outputsamples_buffer_a,
+                                           outputsamples,
+                                           readsamplesize,
+                                           predictor_coef_table_a,
+                                           predictor_coef_num_a,
+                                           prediction_quantitization_a,
+                                           alac->generic_predictors);
+        }
         else
-        { /* not compressed, easy case */
-            if (alac->setinfo_sample_size <= 16)
+        { /* see mono case */
+            fprintf(stderr, "FIXME: unhandled predicition type: %i\n", prediction_type_a);
+        }
+
+        /* channel 2 */
+        entropy_rice_decode(bs,
+                            predicterror_buffer_b,
+                            outputsamples,
+                            readsamplesize,
+                            alac->setinfo_rice_initialhistory,
+                            alac->setinfo_rice_kmodifier,
+                            ricemodifier_b * alac->setinfo_rice_historymult / 4,
+                            (1 << alac->setinfo_rice_kmodifier) - 1);
+
+        if (prediction_type_b == 0)
+        { /* adaptive fir */
+            predictor_decompress_fir_adapt(predicterror_buffer_b,
+                                           outputsamples_buffer_b,
+                                           outputsamples,
+                                           readsamplesize,
+                                           predictor_coef_table_b,
+                                           predictor_coef_num_b,
+                                           prediction_quantitization_b,
+                                           alac->generic_predictors);
+        }
+        else
+        {
+            fprintf(stderr, "FIXME: unhandled predicition type: %i\n", prediction_type_b);
+        }
+    }
+    else
+    { /* not compressed, easy case */
+        if (alac->setinfo_sample_size <= 16)
+        {
+            int i;
+            for (i = 0; i < outputsamples; i++)
             {
-                int i;
-                for (i = 0; i < outputsamples; i++)
-                {
-                    int32_t audiobits_a, audiobits_b;
+                int32_t audiobits_a, audiobits_b;
 
-                    audiobits_a = readbits(alac, alac->setinfo_sample_size);
-                    audiobits_b = readbits(alac, alac->setinfo_sample_size);
+                audiobits_a = readbits(bs, alac->setinfo_sample_size);
+                audiobits_b = readbits(bs, alac->setinfo_sample_size);
 
-                    audiobits_a = SIGN_EXTENDED32(audiobits_a, alac->setinfo_sample_size);
-                    audiobits_b = SIGN_EXTENDED32(audiobits_b, alac->setinfo_sample_size);
+                audiobits_a = SIGN_EXTENDED32(audiobits_a, alac->setinfo_sample_size);
+                audiobits_b = SIGN_EXTENDED32(audiobits_b, alac->setinfo_sample_size);
 
-                    alac->outputsamples_buffer_a[i] = audiobits_a;
-                    alac->outputsamples_buffer_b[i] = audiobits_b;
-                }
+                outputsamples_buffer_a[i] = audiobits_a;
+                outputsamples_buffer_b[i] = audiobits_b;
             }
-            else
+        }
+        else
+        {
+            int i;
+            for (i = 0; i < outputsamples; i++)
             {
-                int i;
-                for (i = 0; i < outputsamples; i++)
-                {
-                    int32_t audiobits_a, audiobits_b;
+                uint32_t audiobits_a, audiobits_b;
 
-                    audiobits_a = readbits(alac, 16);
-                    audiobits_a = audiobits_a << (alac->setinfo_sample_size - 16);
-                    audiobits_a |= readbits(alac, alac->setinfo_sample_size - 16);
-                    audiobits_a = SignExtend24(audiobits_a);
+                audiobits_a = readbits(bs, 16);
+                audiobits_a = audiobits_a << (alac->setinfo_sample_size - 16);
+                audiobits_a |= readbits(bs, alac->setinfo_sample_size - 16);
+                audiobits_a = (int32_t)(audiobits_a << (32 - alac->setinfo_sample_size)) >> (32 - alac->setinfo_sample_size);
 
-                    audiobits_b = readbits(alac, 16);
-                    audiobits_b = audiobits_b << (alac->setinfo_sample_size - 16);
-                    audiobits_b |= readbits(alac, alac->setinfo_sample_size - 16);
-                    audiobits_b = SignExtend24(audiobits_b);
+                audiobits_b = readbits(bs, 16);
+                audiobits_b = audiobits_b << (alac->setinfo_sample_size - 16);
+                audiobits_b |= readbits(bs, alac->setinfo_sample_size - 16);
+                audiobits_b = (int32_t)(audiobits_b << (32 - alac->setinfo_sample_size)) >> (32 - alac->setinfo_sample_size);
 
-                    alac->outputsamples_buffer_a[i] = audiobits_a;
-                    alac->outputsamples_buffer_b[i] = audiobits_b;
-                }
+                outputsamples_buffer_a[i] = audiobits_a;
+                outputsamples_buffer_b[i] = audiobits_b;
             }
-            uncompressed_bytes = 0; // always 0 for uncompressed
-            interlacing_shift = 0;
-            interlacing_leftweight = 0;
         }
+        uncompressed_bytes = 0; // always 0 for uncompressed
+        interlacing_shift = 0;
+        interlacing_leftweight = 0;
+    }
 
-        switch(alac->setinfo_sample_size)
-        {
-        case 16:
-        {
-            deinterlace_16(alac->outputsamples_buffer_a,
-                           alac->outputsamples_buffer_b,
-                           (int16_t*)outbuffer,
-                           alac->numchannels,
-                           outputsamples,
-                           interlacing_shift,
-                           interlacing_leftweight);
-            break;
-        }
-        case 24:
-        {
-            deinterlace_24(alac->outputsamples_buffer_a,
-                           alac->outputsamples_buffer_b,
+    if (convert_output(alac))
+    {
+        deinterlace_convert(alac,
+                            outputsamples_buffer_a,
+                            outputsamples_buffer_b,
+                            uncompressed_bytes,
+                            uncompressed_bytes_buffer_a,
+                            uncompressed_bytes_buffer_b,
+                            buffer_out,
+                            outputsamples,
+                            interlacing_shift,
+                            interlacing_leftweight);
+        return outputsamples;
+    }
+
+    switch(alac->setinfo_sample_size)
+    {
+    case 16:
+    {
+        deinterlace_16(outputsamples_buffer_a,
+                       outputsamples_buffer_b,
+                       (int16_t*)buffer_out,
+                       alac->numchannels,
+                       outputsamples,
+                       interlacing_shift,
+                       interlacing_leftweight,
+                       use_simd);
+        break;
+    }
+    case 24:
+    {
+        deinterlace_24(outputsamples_buffer_a,
+                       outputsamples_buffer_b,
+                       uncompressed_bytes,
+                       uncompressed_bytes_buffer_a,
+                       uncompressed_bytes_buffer_b,
+                       (int16_t*)buffer_out,
+                       alac->numchannels,
+                       outputsamples,
+                       interlacing_shift,
+                       interlacing_leftweight,
+                       use_simd);
+        break;
+    }
+    case 20:
+    case 32:
+        deinterlace_packed(alac,
+                           outputsamples_buffer_a,
+                           outputsamples_buffer_b,
                            uncompressed_bytes,
-                           alac->uncompressed_bytes_buffer_a,
-                           alac->uncompressed_bytes_buffer_b,
-                           (int16_t*)outbuffer,
-                           alac->numchannels,
+                           uncompressed_bytes_buffer_a,
+                           uncompressed_bytes_buffer_b,
+                           buffer_out,
                            outputsamples,
                            interlacing_shift,
                            interlacing_leftweight);
+        break;
+    default:
+        break;
+    }
+    return outputsamples;
+}
+
+/* element tags. a frame is a sequence of elements ending with ID_END */
+#define ID_SCE 0 /* single channel */
+#define ID_CPE 1 /* channel pair */
+#define ID_CCE 2 /* coupling channel, unused by alac */
+#define ID_LFE 3 /* low frequency, coded like a single channel */
+#define ID_DSE 4 /* data stream */
+#define ID_PCE 5 /* program config */
+#define ID_FIL 6 /* fill */
+#define ID_END 7
+
+/* where each channel goes in the output, by channel count. streams send
+ * their elements in alac channel order:
+ *   3 C L R, 4 C L R Cs, 5 C L R Ls Rs, 6 C L R Ls Rs LFE,
+ *   7 C L R Ls Rs Cs LFE, 8 C Lc Rc L R Ls Rs LFE
+ * and they are output in the order ALSA and WAVE files use:
+ *   FL FR RL RR FC LFE, then RC for 6.1 or SL SR for 7.1.
+ * 3.0 and 4.0 have no rear pair, so go out as FL FR FC (RC).
+ * the two channels of a pair always stay next to each other. */
+static const uint8_t channel_map[ALAC_MAX_CHANNELS + 1][ALAC_MAX_CHANNELS] = {
+    { 0 },
+    { 0 },
+    { 0, 1 },
+    { 2, 0, 1 },
+    { 2, 0, 1, 3 },
+    { 4, 0, 1, 2, 3 },
+    { 4, 0, 1, 2, 3, 5 },
+    { 4, 0, 1, 2, 3, 6, 5 },
+    { 4, 6, 7, 0, 1, 2, 3, 5 },
+};
+
+/* silence alac channels first..numchannels-1, for a frame that ended
+ * before they were decoded */
+static void zero_channels(alac_file *alac, void *outbuffer, int first,
+                          int32_t outputsamples)
+{
+    const uint8_t *map = channel_map[alac->numchannels];
+    int samplebytes = alac->bytespersample / alac->numchannels;
+    int i, c;
+
+    for (i = 0; i < outputsamples; i++)
+        for (c = first; c < alac->numchannels; c++)
+            memset((uint8_t*)outbuffer + (i * alac->numchannels + map[c]) * samplebytes,
+                   0, samplebytes);
+}
+
+void alac_decode_frame(alac_file *alac,
+                       unsigned char *inbuffer,
+                       void *outbuffer, int *outputsize)
+{
+    int32_t outputsamples = alac->setinfo_max_samples_per_frame;
+    int use_simd = !alac->scalar_deinterlace && simd_supported();
+    /* bytes per output sample of one channel */
+    int samplebytes = alac->bytespersample / alac->numchannels;
+    int channel = 0;
+
+    bitstream bs;
+
+    /* setup the stream */
+    bits_init(&bs, inbuffer);
+
+    *outputsize = outputsamples * alac->bytespersample;
+
+    /* multichannel streams send their elements in alac channel order,
+     * e.g. C, L R, Ls Rs, LFE for 5.1; see channel_map */
+    while (channel < alac->numchannels)
+    {
+        const uint8_t *map = channel_map[alac->numchannels];
+        int tag = readbits(&bs, 3);
+        void *out = (uint8_t*)outbuffer + map[channel] * samplebytes;
+        int count;
+
+        switch (tag)
+        {
+        case ID_SCE:
+        case ID_LFE:
+            outputsamples = decode_sce(alac, &bs, channel, out, outputsamples);
+            channel += 1;
             break;
-        }
-        case 20:
-        case 32:
-            fprintf(stderr, "FIXME: unimplemented sample size %i\n", alac->setinfo_sample_size);
+        case ID_CPE:
+            /* a pair is written to adjacent channels; one that isn't
+             * where the layout has a pair doesn't fit */
+            if (channel + 2 > alac->numchannels ||
+                map[channel + 1] != map[channel] + 1)
+                goto done;
+            count = decode_cpe(alac, &bs, channel, out, outputsamples, use_simd);
+            if (count < 0)
+                goto done;
+            outputsamples = count;
+            channel += 2;
             break;
+        case ID_DSE:
+        {
+            /* ancillary data, skipped as the reference decoder does:
+             * a 4 bit instance tag, a byte align flag, then the count */
+            int align;
+            readbits(&bs, 4);
+            align = readbits(&bs, 1);
+            count = readbits(&bs, 8);
+            if (count == 255)
+                count += readbits(&bs, 8);
+            if (align)
+                bits_align(&bs);
+            bits_advance(&bs, count * 8);
+            continue;
+        }
+        case ID_FIL:
+            /* padding to a constant bit rate */
+            count = readbits(&bs, 4);
+            if (count == 15)
+                count += readbits(&bs, 8) - 1;
+            bits_advance(&bs, count * 8);
+            continue;
+        case ID_END:
+            goto done;
         default:
-            break;
+            /* CCE and PCE aren't used by alac, and can't be skipped
+             * without being parsed */
+            fprintf(stderr, "FIXME: unhandled element type: %i\n", tag);
+            goto done;
         }
+        *outputsize = outputsamples * alac->bytespersample;
 
-        break;
+        /* mono and stereo streams are a single audio element. stopping
+         * after it also keeps a mono frame in a stereo context from
+         * reading on past its end */
+        if (alac->numchannels <= 2)
+            break;
     }
+
+done:
+    /* a mono stream decoded as stereo plays in both */
+    if (channel == 1 && alac->numchannels == 2)
+    {
+        int i;
+        for (i = 0; i < outputsamples; i++)
+            memcpy((uint8_t*)outbuffer + (2 * i + 1) * samplebytes,
+                   (uint8_t*)outbuffer + 2 * i * samplebytes, samplebytes);
+        return;
     }
+    /* don't leave the last frame's samples in the channels we didn't get
+     * to. *outputsize is that of the channels we did get, or a whole
+     * frame */
+    if (channel < alac->numchannels)
+        zero_channels(alac, outbuffer, channel, outputsamples);
 }
 
 alac_file *alac_create(int samplesize, int numchannels)
 {
     alac_file *newfile = malloc(sizeof(alac_file));
 
-    memset(newfile, 0, sizeof(alac_file));
-
-    newfile->samplesize = samplesize;
-    newfile->numchannels = numchannels;
-    newfile->bytespersample = (samplesize / 8) * numchannels;
+    init_context(newfile, samplesize, numchannels);
+    newfile->context_owned = 1;
 
     return newfile;
 }
 
+void alac_set_gain(alac_file *alac, int64_t gain, int64_t step)
+{
+    alac->output_gain = gain;
+    alac->output_step = step;
+}
+
+void alac_set_output(alac_file *alac, int format)
+{
+    int bytes;
+
+    alac->output_format = format;
+
+    switch (format)
+    {
+    case ALAC_OUTPUT_S16:
+        bytes = 2;
+        break;
+    case ALAC_OUTPUT_S32:
+        bytes = 4;
+        break;
+    default:
+        bytes = (alac->samplesize + 7) / 8;
+        break;
+    }
+    alac->bytespersample = bytes * alac->numchannels;
+}
+
@@ -1,10 +1,21 @@
 #ifndef __ALAC__DECOMP_H
 #define __ALAC__DECOMP_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct alac_file alac_file;
 
+/* the bit reader loads whole words, so it may read up to 15 bytes past
+ * the end of a well formed frame. input buffers must be padded by this
+ * much, see bits_refill in alac.c */
+#define ALAC_INPUT_PADDING 16
+
+/* up to 7.1. multichannel output is interleaved in ALSA/WAVE order,
+ * FL FR RL RR FC LFE ..., see channel_map in alac.c. a mono stream
+ * decoded with two channels comes out in both */
+#define ALAC_MAX_CHANNELS 8
+
 alac_file *alac_create(int samplesize, int numchannels);
 void alac_decode_frame(alac_file *alac,
                        unsigned char *inbuffer,
@@ -13,26 +24,58 @@ void alac_set_info(alac_file *alac, char *inputbuffer);
 void alac_allocate_buffers(alac_file *alac);
 void alac_free(alac_file *alac);
 
+/* a decoder context and its buffers can also live in a single block of
+ * caller owned memory, e.g. one slot of a preallocated pool. mem must be
+ * aligned to ALAC_ALIGN and at least alac_context_size() bytes long.
+ * such a context holds no other resources and is released by releasing
+ * mem; don't pass it to alac_free unless alac_allocate_buffers was
+ * called on it. no state is shared between contexts, so separate
+ * contexts may decode concurrently. */
+#define ALAC_ALIGN 64
+size_t alac_context_size(int numchannels, uint32_t max_samples_per_frame);
+size_t alac_buffers_size(int numchannels, uint32_t max_samples_per_frame);
+alac_file *alac_init_context(void *mem, int samplesize, int numchannels,
+                             uint32_t max_samples_per_frame);
+
+/* output formats for alac_decode_frame. NATIVE is packed little endian
+ * at the stream's sample size; the others are converted while
+ * deinterlacing: S16 keeps the top 16 bits, S32 is msb aligned. */
+#define ALAC_OUTPUT_NATIVE  0
+#define ALAC_OUTPUT_S16     1
+#define ALAC_OUTPUT_S32     2
+void alac_set_output(alac_file *alac, int format);
+
+/* the S16 and S32 outputs are scaled by gain in the same pass, S16 with
+ * TPDF dither when it attenuates. gain is 16.16 fixed point scaled up by
+ * another 16 bits, and step is added to it after each sample, so that a
+ * frame can ramp it. it holds for every frame until set again. */
+void alac_set_gain(alac_file *alac, int64_t gain, int64_t step);
+
 struct alac_file
 {
-    unsigned char *input_buffer;
-    int input_buffer_bitaccumulator; /* used so we can do arbitary
-                                        bit reads */
-
     int samplesize;
     int numchannels;
     int bytespersample;
 
+    int generic_predictors; /* always use the generic predictor code,
+                               for testing and benchmarking */
+    int scalar_deinterlace; /* never use the SIMD deinterlacing code,
+                               for testing and benchmarking */
+
+    /* see alac_set_output and alac_set_gain */
+    int output_format;
+    int64_t output_gain, output_step;
+    uint32_t dither_state;
 
-    /* buffers */
-    int32_t *predicterror_buffer_a;
-    int32_t *predicterror_buffer_b;
 
-    int32_t *outputsamples_buffer_a;
-    int32_t *outputsamples_buffer_b;
+    /* buffers, all carved out of one ALAC_ALIGN aligned arena */
+    void *arena;
+    int arena_owned;
+    int context_owned;
 
-    int32_t *uncompressed_bytes_buffer_a;
-    int32_t *uncompressed_bytes_buffer_b;
+    int32_t *predicterror_buffer[ALAC_MAX_CHANNELS];
+    int32_t *outputsamples_buffer[ALAC_MAX_CHANNELS];
+    int32_t *uncompressed_bytes_buffer[ALAC_MAX_CHANNELS];
 
 
 
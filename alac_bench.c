@@ -0,0 +1,778 @@
+/*
+ * ALAC decoder benchmark.
+ *
+ * Decodes a corpus of ALAC frames with alac_decode_frame and reports the
+ * throughput of each decoder code path (specialised vs generic
+ * predictors, SIMD vs scalar deinterlacing). All paths must produce
+ * identical output; a mismatch is reported and fails the run.
+ *
+ * The corpus is generated by a small built-in encoder, plus any capture
+ * files given on the command line. A capture file is a sequence of
+ * decrypted frames, each preceded by its length as a 16-bit big endian
+ * integer. Captures are decoded with the fmtp parameters given with -f,
+ * in the same format as the SDP a=fmtp line.
+ *
+ * It also times packet decryption: the old AES_cbc_encrypt into a stack
+ * copy, against the per stream EVP context decrypting in place that
+ * player.c uses now. And the player's drift correction on a frame:
+ * sample stuffing, the in-tree resampler, and the conversions to and
+ * from float that libsamplerate needs. Built with -DFANCY_RESAMPLING,
+ * libsamplerate itself is timed too.
+ *
+ * usage: alac_bench [-t seconds] [-f "96 352 0 16 40 10 14 2 255 0 0 44100"] [capture...]
+ *
+ * Every frame is copied into its own buffer with exactly
+ * ALAC_INPUT_PADDING bytes after it, so building with
+ *   make alac_bench CFLAGS="-O1 -g -fsanitize=address"
+ * checks that the decoder stays within the padding it asks for.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+// the legacy AES interface is only here to compare against
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/aes.h>
+#include <openssl/evp.h>
+#include "alac.h"
+#include "resample.h"
+#ifdef FANCY_RESAMPLING
+#include <samplerate.h>
+#endif
+
+#define MAX_FRAME_BYTES 16384
+#define SYNTH_FRAMES    500
+
+typedef struct {
+    char name[64];
+    int nframes;
+    unsigned char **frames;
+    int *lengths;
+    int32_t fmtp[12];
+} corpus;
+
+static const struct {
+    const char *name;
+    int generic_predictors;
+    int scalar_deinterlace;
+} code_paths[] = {
+    { "specialised+simd", 0, 0 },
+    { "specialised+scalar", 0, 1 },
+    { "generic+simd", 1, 0 },
+    { "generic+scalar", 1, 1 },
+};
+#define NPATHS (sizeof(code_paths)/sizeof(code_paths[0]))
+
+static void die(const char *msg) {
+    fprintf(stderr, "alac_bench: %s\n", msg);
+    exit(1);
+}
+
+static void parse_fmtp(int32_t fmtp[12], char *s) {
+    int i;
+    for (i=0; i<12; i++) {
+        char *tok = strsep(&s, " \t");
+        if (!tok)
+            die("fmtp needs 12 fields");
+        fmtp[i] = atoi(tok);
+    }
+}
+
+// the same setup as init_decoder in player.c
+static alac_file *bench_decoder(int32_t fmtp[12], void **mem) {
+    alac_file *alac;
+    int frame_size = fmtp[1];
+
+    if (posix_memalign(mem, ALAC_ALIGN, alac_context_size(fmtp[7], frame_size)))
+        die("out of memory");
+    alac = alac_init_context(*mem, fmtp[3], fmtp[7], frame_size);
+
+    alac->setinfo_7a =      fmtp[2];
+    alac->setinfo_sample_size = fmtp[3];
+    alac->setinfo_rice_historymult = fmtp[4];
+    alac->setinfo_rice_initialhistory = fmtp[5];
+    alac->setinfo_rice_kmodifier = fmtp[6];
+    alac->setinfo_7f =      fmtp[7];
+    alac->setinfo_80 =      fmtp[8];
+    alac->setinfo_82 =      fmtp[9];
+    alac->setinfo_86 =      fmtp[10];
+    alac->setinfo_8a_rate = fmtp[11];
+    return alac;
+}
+
+static void corpus_add(corpus *c, const unsigned char *data, int len) {
+    if (len > MAX_FRAME_BYTES)
+        die("frame too long");
+    c->frames = realloc(c->frames, (c->nframes+1) * sizeof(*c->frames));
+    c->lengths = realloc(c->lengths, (c->nframes+1) * sizeof(*c->lengths));
+    // zeroed padding for the decoder's bit reader
+    c->frames[c->nframes] = calloc(1, len + ALAC_INPUT_PADDING);
+    memcpy(c->frames[c->nframes], data, len);
+    c->lengths[c->nframes] = len;
+    c->nframes++;
+}
+
+static void corpus_free(corpus *c) {
+    int i;
+    for (i=0; i<c->nframes; i++)
+        free(c->frames[i]);
+    free(c->frames);
+    free(c->lengths);
+}
+
+static void load_capture(corpus *c, const char *path) {
+    unsigned char buf[MAX_FRAME_BYTES];
+    unsigned char hdr[2];
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        die("can't open capture file");
+
+    snprintf(c->name, sizeof(c->name), "%s", path);
+    while (fread(hdr, 1, 2, f) == 2) {
+        int len = (hdr[0] << 8) | hdr[1];
+        if (len > MAX_FRAME_BYTES || fread(buf, 1, len, f) != len)
+            die("truncated capture file");
+        corpus_add(c, buf, len);
+    }
+    fclose(f);
+    if (!c->nframes)
+        die("empty capture file");
+}
+
+
+// a minimal encoder, the mirror image of the decoder, used to build the
+// synthetic corpus. it makes no attempt to pick good predictors: all
+// frames start from a first order predictor and rely on adaptation.
+
+typedef struct {
+    unsigned char *buf;
+    long pos;
+    int overflow;
+} bitwriter;
+
+#define SIGN_EXTEND(v, bits) ((int32_t)((uint32_t)(v) << (32-(bits))) >> (32-(bits)))
+
+static void put_bits(bitwriter *w, uint32_t v, int n) {
+    int i;
+    for (i=n-1; i>=0; i--) {
+        if ((v >> i) & 1)
+            w->buf[w->pos >> 3] |= 0x80 >> (w->pos & 7);
+        w->pos++;
+    }
+}
+
+static int count_leading_zeros(uint32_t v) {
+    return v ? __builtin_clz(v) : 32;
+}
+
+static void put_value(bitwriter *w, uint32_t x, int k, int rss) {
+    uint32_t m = (1u << k) - 1;
+    uint32_t q = (k == 1) ? x : x / m;
+    uint32_t r = (k == 1) ? 0 : x % m;
+
+    if (rss < 32 && x >= (1u << rss))
+        w->overflow = 1;
+    if (q > 8) {
+        // escape: 9 ones, then the raw value
+        put_bits(w, 0x1ff, 9);
+        put_bits(w, x, rss);
+        return;
+    }
+    put_bits(w, (1u << q) - 1, q);
+    put_bits(w, 0, 1);
+    if (k != 1) {
+        if (r == 0)
+            put_bits(w, 0, k-1);
+        else
+            put_bits(w, r+1, k);
+    }
+}
+
+static void put_rice(bitwriter *w, const int32_t *err, int n, int rss,
+                     int initialhistory, int kmodifier, int historymult) {
+    int history = initialhistory;
+    int signmod = 0;
+    int i;
+
+    for (i=0; i<n; i++) {
+        int32_t e = err[i];
+        uint32_t v = e >= 0 ? 2u*e : -2u*e - 1;
+        int k = 31 - kmodifier - count_leading_zeros((history >> 9) + 3);
+        k = k < 0 ? k + kmodifier : kmodifier;
+
+        put_value(w, v - signmod, k, rss);
+        signmod = 0;
+
+        history += v * historymult - ((history * historymult) >> 9);
+        if (v > 0xffff)
+            history = 0xffff;
+
+        if (history < 128 && i+1 < n) {
+            int run = 0;
+            while (i+1+run < n && err[i+1+run] == 0 && run < 0xffff)
+                run++;
+            k = count_leading_zeros(history) + ((history + 16) >> 6) - 24;
+            put_value(w, run, k, 16);
+            i += run;
+            signmod = 1;
+            history = 0;
+        }
+    }
+}
+
+// run the decoder's adaptive predictor over in[], writing the residual
+static void fir_residual(const int32_t *in, int32_t *err, int n, int rss,
+                         int16_t *coef, int ntaps, int quant) {
+    int32_t out[4096 + 32];
+    int32_t *hist = out;
+    int i, j;
+
+    err[0] = in[0];
+    out[0] = in[0];
+    if (ntaps == 31) {
+        for (i=1; i<n; i++)
+            err[i] = SIGN_EXTEND(in[i] - in[i-1], rss);
+        return;
+    }
+    for (i=0; i<ntaps && i+1<n; i++) {
+        err[i+1] = SIGN_EXTEND(in[i+1] - in[i], rss);
+        out[i+1] = in[i+1];
+    }
+    for (i=ntaps+1; i<n; i++) {
+        int sum = 0, pred, e, pn;
+
+        for (j=0; j<ntaps; j++)
+            sum += (hist[ntaps-j] - hist[0]) * coef[j];
+        pred = hist[0] + (((1 << (quant-1)) + sum) >> quant);
+        e = SIGN_EXTEND(in[i] - pred, rss);
+        err[i] = e;
+        hist[ntaps+1] = SIGN_EXTEND(pred + e, rss);
+
+        // adapt the coefficients, as predictor_decompress_fir_adapt does
+        if (e > 0) {
+            for (pn=ntaps-1; pn>=0 && e>0; pn--) {
+                int val = hist[0] - hist[ntaps-pn];
+                int sign = (val > 0) - (val < 0);
+                coef[pn] -= sign;
+                e -= ((val * sign) >> quant) * (ntaps - pn);
+            }
+        } else if (e < 0) {
+            for (pn=ntaps-1; pn>=0 && e<0; pn--) {
+                int val = hist[0] - hist[ntaps-pn];
+                int sign = (val < 0) - (val > 0);
+                coef[pn] -= sign;
+                e -= ((val * sign) >> quant) * (ntaps - pn);
+            }
+        }
+        hist++;
+    }
+}
+
+// samples are fmtp[3] bits wide. the low ubytes bytes of each are stored
+// as they are, and only the rest goes through the predictors
+static int encode_frame(unsigned char *buf, const int32_t *left, const int32_t *right,
+                        int n, int ntaps, int interlace, int ubytes, int32_t fmtp[12]) {
+    int32_t a[4096], b[4096], err[4096];
+    const int shift = 2, weight = interlace ? 2 : 0;
+    const int bits = fmtp[3], ubits = ubytes * 8;
+    const int quant = 9, rss = bits - ubits + 1;
+    const uint32_t umask = (1u << ubits) - 1;
+    bitwriter w = { buf, 0, 0 };
+    int i, ch;
+
+    memset(buf, 0, MAX_FRAME_BYTES);
+    put_bits(&w, 2-1, 3);     // channels
+    put_bits(&w, 0, 16);
+    put_bits(&w, 0, 1);       // no sample count, frame is full size
+    put_bits(&w, ubytes, 2);
+    put_bits(&w, 0, 1);       // compressed
+    put_bits(&w, shift, 8);
+    put_bits(&w, weight, 8);
+
+    for (i=0; i<n; i++) {
+        int32_t l = left[i] >> ubits, r = right[i] >> ubits;
+        if (weight) {
+            int32_t d = l - r;
+            a[i] = r + ((d * weight) >> shift);
+            b[i] = d;
+        } else {
+            a[i] = l;
+            b[i] = r;
+        }
+    }
+
+    for (ch=0; ch<2; ch++) {
+        put_bits(&w, 0, 4);   // prediction type
+        put_bits(&w, quant, 4);
+        put_bits(&w, 4, 3);   // rice modifier
+        put_bits(&w, ntaps, 5);
+        for (i=0; i<ntaps; i++)
+            put_bits(&w, i == ntaps-1 ? 1 << quant : 0, 16);
+    }
+    for (i=0; ubytes && i<n; i++) {
+        put_bits(&w, left[i] & umask, ubits);
+        put_bits(&w, right[i] & umask, ubits);
+    }
+    for (ch=0; ch<2; ch++) {
+        int16_t coef[32] = { 0 };
+        if (ntaps != 31)
+            coef[ntaps-1] = 1 << quant;
+        fir_residual(ch ? b : a, err, n, rss, coef, ntaps, quant);
+        put_rice(&w, err, n, rss, fmtp[5], fmtp[6], fmtp[4]);
+    }
+
+    if (w.overflow) {
+        // residual too large for the escape code, store the frame as is
+        memset(buf, 0, MAX_FRAME_BYTES);
+        w.pos = 0;
+        put_bits(&w, 2-1, 3);
+        put_bits(&w, 0, 16);
+        put_bits(&w, 0, 1);
+        put_bits(&w, 0, 2);
+        put_bits(&w, 1, 1);   // not compressed
+        for (i=0; i<n; i++) {
+            put_bits(&w, left[i], bits);
+            put_bits(&w, right[i], bits);
+        }
+    }
+    put_bits(&w, 7, 3);       // end tag
+    return (w.pos + 7) >> 3;
+}
+
+static uint32_t lcg_state = 12345;
+static int32_t noise(int amplitude) {
+    lcg_state = lcg_state * 1103515245 + 12345;
+    return (int32_t)((lcg_state >> 16) % (2*amplitude + 1)) - amplitude;
+}
+
+// the decoder's native output: little endian, packed
+static unsigned char *put_sample(unsigned char *p, int32_t v, int bytes) {
+    int i;
+    for (i=0; i<bytes; i++)
+        *p++ = (uint32_t)v >> (8*i);
+    return p;
+}
+
+// a few seconds of correlated stereo tones and noise, scaled up by
+// 2^scale with noise in the bits below
+static void synth_corpus(corpus *c, const char *name, int ntaps, int interlace,
+                         int ubytes, int scale, int32_t fmtp[12], unsigned char *source) {
+    unsigned char buf[MAX_FRAME_BYTES];
+    int32_t left[4096], right[4096];
+    int frame_size = fmtp[1];
+    int bytes = fmtp[3] / 8;
+    long t = 0;
+    int f, i;
+
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    memcpy(c->fmtp, fmtp, sizeof(c->fmtp));
+    for (f=0; f<SYNTH_FRAMES; f++) {
+        for (i=0; i<frame_size; i++, t++) {
+            double x = 6000.0 * sin(t * 0.0313) + 2500.0 * sin(t * 0.271 + 1.0);
+            left[i] = (int32_t)(x * (1 << scale)) + noise(40 << scale);
+            right[i] = (int32_t)((0.8 * x + 1500.0 * sin(t * 0.0071)) * (1 << scale)) +
+                       noise(40 << scale);
+            source = put_sample(source, left[i], bytes);
+            source = put_sample(source, right[i], bytes);
+        }
+        corpus_add(c, buf, encode_frame(buf, left, right, frame_size, ntaps, interlace,
+                                        ubytes, fmtp));
+    }
+}
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t cycles(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint64_t hash_output(uint64_t h, const unsigned char *p, int len) {
+    int i;
+    for (i=0; i<len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// decode the whole corpus once, returning a hash of the output
+static uint64_t decode_corpus(alac_file *alac, corpus *c, unsigned char *out,
+                              const unsigned char *check) {
+    uint64_t h = 1469598103934665603ULL;
+    int frame_bytes = alac->bytespersample * c->fmtp[1];
+    int f, outsize;
+
+    for (f=0; f<c->nframes; f++) {
+        alac_decode_frame(alac, c->frames[f], out, &outsize);
+        if (outsize != frame_bytes)
+            die("unexpected output size");
+        if (check && memcmp(out, check + (long)f*frame_bytes, frame_bytes))
+            die("synthetic corpus doesn't round trip");
+        h = hash_output(h, out, outsize);
+    }
+    return h;
+}
+
+static int bench_corpus(corpus *c, double min_time, const unsigned char *source) {
+    static unsigned char out[4096*ALAC_MAX_CHANNELS*4];
+    uint64_t reference = 0;
+    int failed = 0;
+    int p;
+
+    printf("%s: %d frames of %d samples\n", c->name, c->nframes, c->fmtp[1]);
+    for (p=0; p<NPATHS; p++) {
+        void *mem;
+        alac_file *alac = bench_decoder(c->fmtp, &mem);
+        double start, elapsed;
+        uint64_t h, c0, ncycles;
+        long frames = 0;
+
+        alac->generic_predictors = code_paths[p].generic_predictors;
+        alac->scalar_deinterlace = code_paths[p].scalar_deinterlace;
+
+        h = decode_corpus(alac, c, out, p ? NULL : source);
+        if (!p)
+            reference = h;
+
+        start = now();
+        c0 = cycles();
+        do {
+            decode_corpus(alac, c, out, NULL);
+            frames += c->nframes;
+            elapsed = now() - start;
+        } while (elapsed < min_time);
+        ncycles = cycles() - c0;
+
+        printf("  %-20s %9.0f frames/s %7.2f ns/sample", code_paths[p].name,
+               frames / elapsed, elapsed * 1e9 / (frames * (double)c->fmtp[1]));
+#ifdef HAVE_RDTSC
+        printf(" %9.0f cycles/frame", (double)ncycles / frames);
+#endif
+        if (h != reference) {
+            printf("  OUTPUT MISMATCH");
+            failed = 1;
+        }
+        printf("\n");
+        free(mem);
+    }
+    return failed;
+}
+
+// the way player.c used to decrypt each packet
+static void decrypt_legacy(AES_KEY *key, const unsigned char *aesiv,
+                           const unsigned char *buf, unsigned char *packet, int len) {
+    unsigned char iv[16];
+    int aeslen = len & ~0xf;
+    memcpy(iv, aesiv, sizeof(iv));
+    AES_cbc_encrypt(buf, packet, aeslen, key, iv, AES_DECRYPT);
+    memcpy(packet+aeslen, buf+aeslen, len-aeslen);
+}
+
+// and the way it does now
+static void decrypt_evp(EVP_CIPHER_CTX *ctx, const unsigned char *aesiv,
+                        unsigned char *buf, int len) {
+    int outl;
+    EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, aesiv);
+    EVP_DecryptUpdate(ctx, buf, &outl, buf, len & ~0xf);
+}
+
+static int bench_decrypt(double min_time) {
+    // about the size of a 352 sample 16 bit stereo packet, with a tail
+    // that isn't a whole block
+    const int len = 1283;
+    unsigned char key[16], iv[16];
+    unsigned char plain[2048], cipher[2048], buf[2048], packet[2048];
+    AES_KEY aes;
+    EVP_CIPHER_CTX *ctx;
+    double start, elapsed;
+    long n;
+    int legacy_bad, evp_bad;
+    int i, outl;
+
+    for (i=0; i<16; i++) {
+        key[i] = noise(127);
+        iv[i] = noise(127);
+    }
+    for (i=0; i<len; i++)
+        plain[i] = noise(127);
+
+    ctx = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, iv);
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    EVP_EncryptUpdate(ctx, cipher, &outl, plain, len & ~0xf);
+    memcpy(cipher + (len & ~0xf), plain + (len & ~0xf), len - (len & ~0xf));
+    EVP_CIPHER_CTX_free(ctx);
+
+    AES_set_decrypt_key(key, 128, &aes);
+    ctx = EVP_CIPHER_CTX_new();
+    EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, iv);
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+    printf("packet decryption: %d byte packets\n", len);
+
+    decrypt_legacy(&aes, iv, cipher, packet, len);
+    legacy_bad = memcmp(packet, plain, len) != 0;
+    start = now();
+    n = 0;
+    do {
+        for (i=0; i<1000; i++)
+            decrypt_legacy(&aes, iv, cipher, packet, len);
+        n += 1000;
+        elapsed = now() - start;
+    } while (elapsed < min_time);
+    printf("  %-20s %9.0f ns/packet %7.0f MB/s%s\n", "AES_cbc_encrypt+copy",
+           elapsed * 1e9 / n, n * (double)len / elapsed / 1e6,
+           legacy_bad ? "  OUTPUT MISMATCH" : "");
+
+    // twice, to check that each packet really starts over from the IV.
+    // after that buf holds garbage, which decrypts just as fast
+    for (i=0; i<2; i++) {
+        memcpy(buf, cipher, len);
+        decrypt_evp(ctx, iv, buf, len);
+    }
+    evp_bad = memcmp(buf, plain, len) != 0;
+    start = now();
+    n = 0;
+    do {
+        for (i=0; i<1000; i++)
+            decrypt_evp(ctx, iv, buf, len);
+        n += 1000;
+        elapsed = now() - start;
+    } while (elapsed < min_time);
+    printf("  %-20s %9.0f ns/packet %7.0f MB/s%s\n", "EVP in place",
+           elapsed * 1e9 / n, n * (double)len / elapsed / 1e6,
+           evp_bad ? "  OUTPUT MISMATCH" : "");
+
+    EVP_CIPHER_CTX_free(ctx);
+    return legacy_bad || evp_bad;
+}
+
+// drift correction of one 16 bit stereo frame at unity gain, the ways
+// player.c can do it
+#define DRIFT_FRAME 352
+#define DRIFT_FRAMES 64
+#define DRIFT_RATIO 1.0001
+
+enum {
+    DRIFT_STUFF,
+    DRIFT_RESAMPLE,
+    DRIFT_FLOAT_SCALAR,
+    DRIFT_FLOAT_SIMD,
+#ifdef FANCY_RESAMPLING
+    DRIFT_SRC,
+#endif
+    DRIFT_METHODS
+};
+static const char *drift_names[] = {
+    "stuffing",
+    "resampler",
+    "float conv scalar",
+    "float conv simd",
+#ifdef FANCY_RESAMPLING
+    "libsamplerate",
+#endif
+};
+
+// as fancy_buffer converted before, and src_float_to_short_array does
+static void float_conv_scalar(const int16_t *in, float *f, int16_t *out, int frames) {
+    float scale = 1.0f / 32768.0f;
+    int i;
+    for (i=0; i<frames; i++) {
+        f[2*i] = in[2*i] * scale;
+        f[2*i+1] = in[2*i+1] * scale;
+    }
+    for (i=0; i<2*frames; i++) {
+        float v = f[i] * 32768.0f;
+        out[i] = v >= 32767.0f ? 32767 : v <= -32768.0f ? -32768 : lrintf(v);
+    }
+}
+
+static int drift_frame(int method, void *state, const int16_t *in, int16_t *out) {
+    static float f_in[2*DRIFT_FRAME], f_out[2*2*DRIFT_FRAME];
+    int half = DRIFT_FRAME / 2;
+
+    switch (method) {
+    case DRIFT_STUFF:
+        // the worst case, a sample added to every frame
+        memcpy(out, in, half * 4);
+        memcpy(out + 2*half, in + 2*half, 4);
+        memcpy(out + 2*half + 2, in + 2*half, (DRIFT_FRAME - half) * 4);
+        return DRIFT_FRAME + 1;
+    case DRIFT_RESAMPLE:
+        return resampler_process(state, in, DRIFT_FRAME, out, DRIFT_RATIO);
+    case DRIFT_FLOAT_SCALAR:
+        float_conv_scalar(in, f_in, out, DRIFT_FRAME);
+        return DRIFT_FRAME;
+    case DRIFT_FLOAT_SIMD:
+        resample_stereo_to_float(in, f_in, DRIFT_FRAME, 1.0f / 32768.0f, 0.0f);
+        resample_float_to_s16(f_in, out, 2*DRIFT_FRAME);
+        return DRIFT_FRAME;
+#ifdef FANCY_RESAMPLING
+    case DRIFT_SRC: {
+        // fancy_buffer, less the volume ramp
+        SRC_DATA srcdat;
+        resample_stereo_to_float(in, f_in, DRIFT_FRAME, 1.0f / 32768.0f, 0.0f);
+        srcdat.data_in = f_in;
+        srcdat.data_out = f_out;
+        srcdat.input_frames = DRIFT_FRAME;
+        srcdat.output_frames = 2*DRIFT_FRAME;
+        srcdat.src_ratio = 1.0 / DRIFT_RATIO;
+        srcdat.end_of_input = 0;
+        src_process(state, &srcdat);
+        resample_float_to_s16(f_out, out, 2*srcdat.output_frames_gen);
+        return srcdat.output_frames_gen;
+    }
+#endif
+    }
+    (void)f_out;
+    return 0;
+}
+
+static int bench_drift(double min_time) {
+    static int16_t in[DRIFT_FRAMES][2*DRIFT_FRAME];
+    static int16_t out[2*2*DRIFT_FRAME], check[2*DRIFT_FRAME];
+    double start, elapsed;
+    long n;
+    int failed = 0;
+    int m, f, i;
+
+    for (f=0; f<DRIFT_FRAMES; f++) {
+        for (i=0; i<DRIFT_FRAME; i++) {
+            double t = f*DRIFT_FRAME + i;
+            in[f][2*i] = 12000.0 * sin(t * 0.0313) + noise(40);
+            in[f][2*i+1] = 9000.0 * sin(t * 0.0071) + noise(40);
+        }
+    }
+    in[0][0] = -32768;  // full scale, both ways
+    in[0][1] = 32767;
+
+    printf("drift correction: frames of %d stereo samples\n", DRIFT_FRAME);
+    for (m=0; m<DRIFT_METHODS; m++) {
+        void *state = NULL;
+        int bad = 0;
+
+        if (m == DRIFT_RESAMPLE)
+            state = resampler_new(2, 16, DRIFT_FRAME);
+#ifdef FANCY_RESAMPLING
+        if (m == DRIFT_SRC) {
+            int err;
+            state = src_new(SRC_SINC_MEDIUM_QUALITY, 2, &err);
+        }
+#endif
+        if (m == DRIFT_FLOAT_SCALAR || m == DRIFT_FLOAT_SIMD) {
+            // at unity gain these must give back what they were given
+            for (f=0; f<DRIFT_FRAMES; f++) {
+                drift_frame(m, state, in[f], check);
+                bad |= memcmp(check, in[f], sizeof(check)) != 0;
+            }
+        }
+
+        start = now();
+        n = 0;
+        do {
+            for (f=0; f<DRIFT_FRAMES; f++)
+                drift_frame(m, state, in[f], out);
+            n += DRIFT_FRAMES;
+            elapsed = now() - start;
+        } while (elapsed < min_time);
+        printf("  %-20s %9.0f ns/frame%s\n", drift_names[m],
+               elapsed * 1e9 / n, bad ? "  OUTPUT MISMATCH" : "");
+        failed |= bad;
+
+        if (m == DRIFT_RESAMPLE)
+            resampler_free(state);
+#ifdef FANCY_RESAMPLING
+        if (m == DRIFT_SRC)
+            src_delete(state);
+#endif
+    }
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    char default_fmtp[] = "96 352 0 16 40 10 14 2 255 0 0 44100";
+    static const struct {
+        const char *name;
+        int ntaps, interlace;
+        int bits, ubytes, scale;
+    } synth[] = {
+        { "synthetic 4-tap", 4, 1, 16, 0, 0 },
+        { "synthetic 8-tap", 8, 0, 16, 0, 0 },
+        { "synthetic 16-tap", 16, 1, 16, 0, 0 },
+        { "synthetic delta", 31, 0, 16, 0, 0 },
+        { "synthetic 24 bit", 8, 1, 24, 0, 4 },
+        { "synthetic 24 bit shifted", 4, 1, 24, 1, 8 },
+        { "synthetic 32 bit", 8, 1, 32, 2, 16 },
+    };
+    int32_t fmtp[12];
+    double min_time = 0.5;
+    unsigned char *source;
+    int failed = 0;
+    int opt, i;
+
+    parse_fmtp(fmtp, default_fmtp);
+    while ((opt = getopt(argc, argv, "t:f:")) != -1) {
+        switch (opt) {
+        case 't':
+            min_time = atof(optarg);
+            break;
+        case 'f':
+            parse_fmtp(fmtp, optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t seconds] [-f fmtp] [capture...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (fmtp[1] <= 0 || fmtp[1] > 4096)
+        die("unsupported frame size");
+    if (fmtp[7] < 1 || fmtp[7] > ALAC_MAX_CHANNELS)
+        die("unsupported channel count");
+
+    for (i=optind; i<argc; i++) {
+        corpus c;
+        memset(&c, 0, sizeof(c));
+        memcpy(c.fmtp, fmtp, sizeof(c.fmtp));
+        load_capture(&c, argv[i]);
+        failed |= bench_corpus(&c, min_time, NULL);
+        corpus_free(&c);
+    }
+
+    source = malloc(SYNTH_FRAMES * 4096 * 2 * sizeof(int32_t));
+    for (i=0; i<sizeof(synth)/sizeof(synth[0]); i++) {
+        int32_t synth_fmtp[12];
+        corpus c;
+        memset(&c, 0, sizeof(c));
+        if (fmtp[3] != 16 || fmtp[7] != 2)
+            break;     // the encoder only does stereo, -f is for captures
+        memcpy(synth_fmtp, fmtp, sizeof(synth_fmtp));
+        synth_fmtp[3] = synth[i].bits;
+        synth_corpus(&c, synth[i].name, synth[i].ntaps, synth[i].interlace,
+                     synth[i].ubytes, synth[i].scale, synth_fmtp, source);
+        failed |= bench_corpus(&c, min_time, source);
+        corpus_free(&c);
+    }
+    free(source);
+
+    failed |= bench_decrypt(min_time);
+    failed |= bench_drift(min_time);
+
+    return failed;
+}
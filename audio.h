@@ -10,9 +10,13 @@ typedef struct {
     // at end of program
     void (*deinit)(void);
 
-    void (*start)(int sample_rate);
-    // block of samples
-    void (*play)(short buf[], int samples);
+    // sample_bits is 16 or 32: interleaved, signed, native endian.
+    // returns the width actually set up, which is 16 if the output can't
+    // take 32 bit samples; play() then gets that width.
+    int (*start)(int sample_rate, int channels, int sample_bits);
+    // block of samples (frames of all channels). buf may be the player's
+    // own buffer, so only read it, and not after returning
+    void (*play)(void *buf, int samples);
     void (*stop)(void);
 
     // may be NULL, in which case soft volume is applied
@@ -36,8 +36,8 @@
 static void help(void);
 static int init(int argc, char **argv);
 static void deinit(void);
-static void start(int sample_rate);
-static void play(short buf[], int samples);
+static int start(int sample_rate, int channels, int sample_bits);
+static void play(void *buf, int samples);
 static void stop(void);
 static void volume(double vol);
 
@@ -150,7 +150,7 @@ static void deinit(void) {
     }
 }
 
-static void start(int sample_rate) {
+static int start(int sample_rate, int channels, int sample_bits) {
     if (sample_rate != 44100)
         die("Unexpected sample rate!");
 
@@ -163,16 +163,24 @@ static void start(int sample_rate) {
     snd_pcm_hw_params_alloca(&alsa_params);
     snd_pcm_hw_params_any(alsa_handle, alsa_params);
     snd_pcm_hw_params_set_access(alsa_handle, alsa_params, SND_PCM_ACCESS_RW_INTERLEAVED);
-    snd_pcm_hw_params_set_format(alsa_handle, alsa_params, SND_PCM_FORMAT_S16);
-    snd_pcm_hw_params_set_channels(alsa_handle, alsa_params, 2);
+    // pass high resolution sources through untouched if the device can
+    if (sample_bits != 32 ||
+        snd_pcm_hw_params_set_format(alsa_handle, alsa_params, SND_PCM_FORMAT_S32) < 0) {
+        sample_bits = 16;
+        snd_pcm_hw_params_set_format(alsa_handle, alsa_params, SND_PCM_FORMAT_S16);
+    }
+    ret = snd_pcm_hw_params_set_channels(alsa_handle, alsa_params, channels);
+    if (ret < 0)
+        die("unable to set %d channels: %s\n", channels, snd_strerror(ret));
     snd_pcm_hw_params_set_rate_near(alsa_handle, alsa_params, (unsigned int *)&sample_rate, &dir);
     snd_pcm_hw_params_set_period_size_near(alsa_handle, alsa_params, &frames, &dir);
     ret = snd_pcm_hw_params(alsa_handle, alsa_params);
     if (ret < 0)
         die("unable to set hw parameters: %s\n", snd_strerror(ret));
+    return sample_bits;
 }
 
-static void play(short buf[], int samples) {
+static void play(void *buf, int samples) {
     int err = snd_pcm_writei(alsa_handle, (char*)buf, samples);
     if (err < 0)
         err = snd_pcm_recover(alsa_handle, err, 0);
@@ -105,12 +105,15 @@ static void deinit(void) {
     ao_shutdown();
 }
 
-static void start(int sample_rate) {
+static int start(int sample_rate, int channels, int sample_bits) {
     if (sample_rate != 44100)
         die("unexpected sample rate!");
+    if (channels != 2)
+        die("only stereo output supported!");
+    return 16;
 }
 
-static void play(short buf[], int samples) {
+static void play(void *buf, int samples) {
     ao_play(dev, (char*)buf, samples*4);
 }
 
@@ -39,14 +39,16 @@ static int init(int argc, char **argv) {
 static void deinit(void) {
 }
 
-static void start(int sample_rate) {
+static int start(int sample_rate, int channels, int sample_bits) {
     Fs = sample_rate;
     starttime = 0;
     samples_played = 0;
-    printf("dummy audio output started at Fs=%d Hz\n", sample_rate);
+    printf("dummy audio output started at Fs=%d Hz, %d channels, %d bit\n",
+           sample_rate, channels, sample_bits);
+    return sample_bits;
 }
 
-static void play(short buf[], int samples) {
+static void play(void *buf, int samples) {
     struct timeval tv;
 
     // this is all a bit expensive but it's long-term stable.
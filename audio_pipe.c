@@ -37,7 +37,7 @@
 
 static int fd = -1;
 static char *pipename = NULL;
-static int Fs;
+static int Fs, Channels;
 static long long starttime, samples_played;
 
 static void stop(void) {
@@ -45,7 +45,7 @@ static void stop(void) {
     fd = -1;
 }
 
-static void start(int sample_rate) {
+static int start(int sample_rate, int channels, int sample_bits) {
     if (fd >= 0)
         stop();
 
@@ -62,8 +62,12 @@ static void start(int sample_rate) {
     }
 
     Fs = sample_rate;
+    Channels = channels;
     starttime = 0;
     samples_played = 0;
+
+    // readers of the pipe expect 16 bit samples
+    return 16;
 }
 
 // Wait procedure taken from audio_dummy.c
@@ -85,18 +89,18 @@ static void wait_samples(int samples) {
     usleep(finishtime - nowtime);
 }
 
-static void play(short buf[], int samples) {
+static void play(void *buf, int samples) {
     if (fd < 0) {
         wait_samples(samples);
 
         // check if the other end is ready every 5 seconds
         if (samples_played > 5 * Fs)
-            start(Fs);
+            start(Fs, Channels, 16);
 
         return;
     }
 
-    if (write(fd, buf, samples*4) < 0)
+    if (write(fd, buf, samples*2*Channels) < 0)
         stop();
 }
 
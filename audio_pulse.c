@@ -101,12 +101,15 @@ static void deinit(void) {
     pa_dev = NULL;
 }
 
-static void start(int sample_rate) {
+static int start(int sample_rate, int channels, int sample_bits) {
     if (sample_rate != 44100)
         die("unexpected sample rate!");
+    if (channels != 2)
+        die("only stereo output supported!");
+    return 16;
 }
 
-static void play(short buf[], int samples) {
+static void play(void *buf, int samples) {
     if( pa_simple_write(pa_dev, (char *)buf, (size_t)samples * 4, &pa_error) < 0 )
         fprintf(stderr, __FILE__": pa_simple_write() failed: %s\n", pa_strerror(pa_error));
 }
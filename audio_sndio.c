@@ -48,13 +48,35 @@ static void deinit(void) {
 	sio_close(sio);
 }
 
-static void start(int sample_rate) {
+static int start(int sample_rate, int channels, int sample_bits) {
 	if (sample_rate != par.rate)
 		die("unexpected sample rate!");
+
+	if (par.bits != sample_bits || par.pchan != channels) {
+		struct sio_par want = par;
+		want.bits = sample_bits;
+		want.bps = sample_bits / 8;
+		want.pchan = channels;
+		if (!sio_setpar(sio, &want) || !sio_getpar(sio, &want) ||
+		    want.bits != sample_bits || want.bps != sample_bits / 8) {
+			// fall back to 16 bit
+			want = par;
+			want.bits = 16;
+			want.bps = 2;
+			want.pchan = channels;
+			if (!sio_setpar(sio, &want) || !sio_getpar(sio, &want) ||
+			    want.bits != 16)
+				die("sndio: failed to set audio parameters");
+		}
+		if (want.pchan != channels)
+			die("sndio: can't play %d channels", channels);
+		par = want;
+	}
 	sio_start(sio);
+	return par.bits;
 }
 
-static void play(short buf[], int samples) {
+static void play(void *buf, int samples) {
 	sio_write(sio, (char *)buf, samples * par.bps * par.pchan);
 }
 
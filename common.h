@@ -27,6 +27,13 @@ typedef struct {
     char *mdns_name;
     mdns_backend *mdns;
     int buffer_start_fill;
+    int buffer_refill;
+    int adaptive_fill;  // the least fill to adapt down to; 0 if off
+    int buffer_frames;
+    int lazy_decode;
+    int decode_threads;
+    int resample;       // correct drift by resampling rather than stuffing
+    int volume_ramp;    // ms over which soft volume changes are spread
     int daemonise;
     char *cmd_start, *cmd_stop;
     int cmd_blocking;
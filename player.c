@@ -28,9 +28,11 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/types.h>
 #include <pthread.h>
-#include <openssl/aes.h>
+#include <openssl/evp.h>
 #include <math.h>
 #include <sys/stat.h>
 #include <sys/signal.h>
@@ -47,57 +49,161 @@
 #endif
 
 #include "alac.h"
+#include "resample.h"
+
+#if defined(__SSE2__)
+#define PLAYER_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PLAYER_NEON
+#include <arm_neon.h>
+#endif
 
 // parameters from the source
-static unsigned char *aesiv;
-static AES_KEY aes;
+static unsigned char *aesiv, *aeskey;
 static int sampling_rate, frame_size;
+// output channels. mono streams go out as stereo, in both
+static int channels;
+// width of the samples in the jitter buffer and handed to the output:
+// 16, or 32 for high resolution sources (msb aligned)
+static int output_bits;
 
-#define FRAME_BYTES(frame_size) (4*frame_size)
+#define FRAME_BYTES(frame_size) ((output_bits/8)*channels*(frame_size))
 // maximal resampling shift - conservative
-#define OUTFRAME_BYTES(frame_size) (4*(frame_size+3))
+#define OUTFRAME_BYTES(frame_size) ((output_bits/8)*channels*(frame_size+3))
 
 static pthread_t player_thread;
 static int please_stop;
 
-static alac_file *decoder_info;
+// a decoder and key schedule, set up once per stream for each thread
+// that decodes
+typedef struct {
+    EVP_CIPHER_CTX *aes;
+    alac_file *alac;
+    void *mem;      // alac context and buffers, one block
+    pthread_t thread;
+} decoder_t;
+// used by the RTP thread, or with config.lazy_decode the player thread
+static decoder_t decoder;
+static decoder_t *workers;
+static int nworkers;
 
 #ifdef FANCY_RESAMPLING
 static int fancy_resampling = 1;
 static SRC_STATE *src;
+static float *src_in, *src_out;     // a frame, and what src makes of it
 #endif
+// with config.resample, unless libsamplerate is doing it
+static resampler *resample_state;
 
 
 // interthread variables
-static double volume = 1.0;
+// soft volume, 16.16 fixed point. the player thread takes a snapshot
+// of it for each frame
 static int fix_volume = 0x10000;
-static pthread_mutex_t vol_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-// default buffer size
-// needs to be a power of 2 because of the way BUFIDX(seqno) works
-#define BUFFER_FRAMES  512
 #define MAX_PACKET      2048
 
-typedef struct audio_buffer_entry {   // decoded audio packets
-    int ready;
-    signed short *data;
+// the jitter buffer is a lock-free single producer, single consumer ring.
+// the RTP thread (player_put_packet) fills slots and advances ab_write,
+// the player thread (buffer_get_frame) consumes them and advances ab_read.
+// a slot's data belongs to the producer until it publishes the slot's
+// ready word, which then holds the packet's seqno | SLOT_READY. with
+// decode workers, the producer marks it seqno | SLOT_PENDING and hands
+// the slot to a worker, which publishes it instead.
+//
+// the producer only writes slots in [ab_read, ab_read + buffer_frames-2],
+// so it never touches the slot the consumer is playing (ab_read - 1).
+typedef struct audio_buffer_entry {   // audio packets
+    uint32_t ready;
+    uint32_t timestamp;     // RTP timestamp of the first sample
+    uint32_t arrival;       // when the packet came in, see monotonic_ms
+    int samples;    // decoded length; the last frame of a stream may be short
+    int len;        // the packet's length, if it is stored undecoded
+    void *data;     // output_bits wide samples, all channels interleaved
+    void *packet;   // the packet as received, for lazy_decode or workers
 } abuf_t;
-static abuf_t audio_buffer[BUFFER_FRAMES];
-#define BUFIDX(seqno) ((seq_t)(seqno) % BUFFER_FRAMES)
-
-// mutex-protected variables
+// the ring is config.buffer_frames long, fixed for the life of a stream.
+// the entries and all of the slots' audio live in one allocation.
+static abuf_t *audio_buffer;
+static int buffer_frames;       // a power of 2 because of the way BUFIDX(seqno) works
+static void *buffer_mem;
+static int packet_bytes;        // room for a packet in each slot, if any
+static void *lazy_frame;        // player thread only, see buffer_get_frame
+static void *plc_history, *plc_frame;   // player thread only, see conceal_frame
+
+// what we have asked the source to resend, one per slot. player thread
+// only, see resend_tick
+typedef struct resend_entry {
+    seq_t seqno;
+    int tries;          // 0 if not asked for yet, or it has arrived
+    int resent;         // it arrived after we asked
+    uint32_t sent;      // when we last asked, see monotonic_ms
+} resend_t;
+static resend_t *resends;
+#define BUFIDX(seqno) ((seq_t)(seqno) & (buffer_frames-1))
+#define SLOT_READY 0x10000
+#define SLOT_PENDING 0x20000
+#define SLOT_HOLDS(ready, seqno) \
+    (((ready) & 0xffff) == (seqno) && ((ready) & (SLOT_READY | SLOT_PENDING)))
+
+#define atomic_load(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define atomic_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+// each side owns one index, and reads the other's
 static seq_t ab_read, ab_write;
-static int ab_buffering = 1, ab_synced = 0;
-static pthread_mutex_t ab_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// flushes and resyncs are commands rather than shared state. player_flush
+// bumps ab_flushes; the producer answers by clearing the ring and
+// publishing a new sync word (SYNC_VALID | flush count << 16 | the seqno
+// to start from) in ab_sync; the consumer adopts it, moves ab_read there
+// and acknowledges by copying it to ab_read_sync.
+static uint32_t ab_flushes, ab_sync, ab_read_sync;
+#define SYNC_VALID 0x80000000
+#define SYNC_FLUSHES(sync) (((sync) >> 16) & 0x7fff)
+#define SYNC_SEQNO(sync) ((seq_t)(sync))
+
+static uint32_t producer_sync;                  // RTP thread only
+static uint32_t consumer_sync;                  // player thread only
+// player thread only. BUFFERING_START fills to buffer_start_fill and
+// starts rate matching afresh; BUFFERING_REFILL, after an underrun, only
+// waits for buffer_refill frames and carries on with what it had learned
+#define BUFFERING_START 1
+#define BUFFERING_REFILL 2
+static int ab_buffering = BUFFERING_START;
+
+// RTP thread only: timestamp of the newest packet, ab_write
+static uint32_t write_timestamp;
+// player thread only: the source's timeline, as the RTP timestamp of
+// the next sample we expect to play
+static uint32_t play_timestamp;
+static int play_timestamp_valid;
 
 static void bf_est_reset(short fill);
+static void adapt_reset(void);
 
-static void ab_resync(void) {
+static void ab_reset(void) {
     int i;
-    for (i=0; i<BUFFER_FRAMES; i++)
+    for (i=0; i<buffer_frames; i++)
         audio_buffer[i].ready = 0;
-    ab_synced = 0;
-    ab_buffering = 1;
+    ab_flushes = ab_sync = ab_read_sync = 0;
+    producer_sync = consumer_sync = 0;
+    ab_buffering = BUFFERING_START;
+    adapt_reset();
+}
+
+static uint32_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// the same clock, in seconds and without the wrap, for clock recovery.
+// rtp.c's local_ntp is this in 32.32 fixed point
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
 // the sequence numbers will wrap pretty often.
@@ -107,40 +213,48 @@ static inline int seq_order(seq_t a, seq_t b) {
     return d > 0;
 }
 
-static void alac_decode(short *dest, uint8_t *buf, int len) {
-    unsigned char packet[MAX_PACKET];
+#if PACKET_PADDING < ALAC_INPUT_PADDING
+#error "PACKET_PADDING must cover ALAC_INPUT_PADDING"
+#endif
+
+// decrypts buf in place, see player_put_packet. returns the number of
+// samples decoded.
+static int alac_decode(decoder_t *d, void *dest, uint8_t *buf, int len) {
     assert(len<=MAX_PACKET);
 
-    unsigned char iv[16];
+    // every packet starts over from the stream's IV. only whole blocks
+    // are encrypted, the tail is sent in the clear.
     int aeslen = len & ~0xf;
-    memcpy(iv, aesiv, sizeof(iv));
-    AES_cbc_encrypt(buf, packet, aeslen, &aes, iv, AES_DECRYPT);
-    memcpy(packet+aeslen, buf+aeslen, len-aeslen);
+    int outl;
+    EVP_DecryptInit_ex(d->aes, NULL, NULL, NULL, aesiv);
+    EVP_DecryptUpdate(d->aes, buf, &outl, buf, aeslen);
 
     int outsize;
 
-    alac_decode_frame(decoder_info, packet, dest, &outsize);
+    alac_decode_frame(d->alac, buf, dest, &outsize);
 
-    assert(outsize == FRAME_BYTES(frame_size));
+    assert(outsize <= FRAME_BYTES(frame_size));
+    return outsize / FRAME_BYTES(1);
 }
 
 
-static int init_decoder(int32_t fmtp[12]) {
+static int open_decoder(decoder_t *d, int32_t fmtp[12]) {
     alac_file *alac;
-
-    frame_size = fmtp[1]; // stereo samples
-    sampling_rate = fmtp[11];
-
+    void *mem;
     int sample_size = fmtp[3];
-    if (sample_size != 16)
-        die("only 16-bit samples supported!");
 
-    alac = alac_create(sample_size, 2);
-    if (!alac)
+    d->aes = EVP_CIPHER_CTX_new();
+    if (!d->aes ||
+        !EVP_DecryptInit_ex(d->aes, EVP_aes_128_cbc(), NULL, aeskey, aesiv))
+        return 1;
+    EVP_CIPHER_CTX_set_padding(d->aes, 0);
+
+    if (posix_memalign(&mem, ALAC_ALIGN, alac_context_size(channels, frame_size)))
         return 1;
-    decoder_info = alac;
+    d->mem = mem;
+    alac = alac_init_context(mem, sample_size, channels, frame_size);
+    d->alac = alac;
 
-    alac->setinfo_max_samples_per_frame = frame_size;
     alac->setinfo_7a =      fmtp[2];
     alac->setinfo_sample_size = sample_size;
     alac->setinfo_rice_historymult = fmtp[4];
@@ -151,102 +265,540 @@ static int init_decoder(int32_t fmtp[12]) {
     alac->setinfo_82 =      fmtp[9];
     alac->setinfo_86 =      fmtp[10];
     alac->setinfo_8a_rate = fmtp[11];
-    alac_allocate_buffers(alac);
+
+    // the decoder converts wider samples while deinterlacing: bit exact
+    // into 32 bits, or down to 16 if that is all the output takes. it
+    // applies the soft volume to lazily decoded frames in the same pass,
+    // see player_thread_func
+    if (sample_size > 16)
+        alac_set_output(alac, output_bits == 32 ? ALAC_OUTPUT_S32 : ALAC_OUTPUT_S16);
+    else if (config.lazy_decode)
+        alac_set_output(alac, ALAC_OUTPUT_S16);
     return 0;
 }
 
+static void close_decoder(decoder_t *d) {
+    EVP_CIPHER_CTX_free(d->aes);
+    free(d->mem);
+    d->aes = NULL;
+    d->mem = NULL;
+    d->alac = NULL;
+}
+
+static int init_decoder(int32_t fmtp[12]) {
+    frame_size = fmtp[1]; // stereo samples
+    sampling_rate = fmtp[11];
+
+    int sample_size = fmtp[3];
+    if (sample_size != 16 && sample_size != 20 &&
+        sample_size != 24 && sample_size != 32)
+        die("unsupported sample size %d", sample_size);
+
+    return open_decoder(&decoder, fmtp);
+}
+
 static void free_decoder(void) {
-    alac_free(decoder_info);
+    close_decoder(&decoder);
+}
+
+// decode workers. player_put_packet copies each packet into its slot and
+// queues the slot; a worker decodes it there and publishes it. the queue
+// can't overflow: a slot has at most one job, and the producer only
+// writes buffer_frames-1 of them.
+typedef struct {
+    abuf_t *abuf;
+    seq_t seqno;
+} decode_job;
+static decode_job *jobs;
+static int job_head, job_count, jobs_active, workers_stop;
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static void *decode_thread_func(void *arg) {
+    decoder_t *d = arg;
+    decode_job job;
+
+    pthread_mutex_lock(&job_mutex);
+    for (;;) {
+        while (!job_count && !workers_stop)
+            pthread_cond_wait(&job_cond, &job_mutex);
+        if (!job_count)
+            break;
+        job = jobs[job_head];
+        job_head = (job_head + 1) & (buffer_frames-1);
+        job_count--;
+        jobs_active++;
+        pthread_mutex_unlock(&job_mutex);
+
+        job.abuf->samples = alac_decode(d, job.abuf->data, job.abuf->packet, job.abuf->len);
+        atomic_store(&job.abuf->ready, job.seqno | SLOT_READY);
+
+        pthread_mutex_lock(&job_mutex);
+        if (!--jobs_active && !job_count)
+            pthread_cond_broadcast(&idle_cond);
+    }
+    pthread_mutex_unlock(&job_mutex);
+
+    return 0;
+}
+
+static void decode_queue(abuf_t *abuf, seq_t seqno) {
+    pthread_mutex_lock(&job_mutex);
+    assert(job_count < buffer_frames);
+    jobs[(job_head + job_count) & (buffer_frames-1)] = (decode_job){abuf, seqno};
+    job_count++;
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&job_mutex);
+}
+
+// wait for the workers to let go of every slot
+static void decode_wait_idle(void) {
+    pthread_mutex_lock(&job_mutex);
+    while (job_count || jobs_active)
+        pthread_cond_wait(&idle_cond, &job_mutex);
+    pthread_mutex_unlock(&job_mutex);
+}
+
+static void init_workers(int32_t fmtp[12]) {
+    int i;
+    if (!nworkers)
+        return;
+
+    jobs = malloc(buffer_frames * sizeof(decode_job));
+    workers = calloc(nworkers, sizeof(decoder_t));
+    if (!jobs || !workers)
+        die("could not allocate decode workers");
+    job_head = job_count = jobs_active = workers_stop = 0;
+    for (i=0; i<nworkers; i++) {
+        if (open_decoder(&workers[i], fmtp))
+            die("could not set up decode worker %d", i);
+        pthread_create(&workers[i].thread, NULL, decode_thread_func, &workers[i]);
+    }
+}
+
+static void free_workers(void) {
+    int i;
+    if (!nworkers)
+        return;
+
+    pthread_mutex_lock(&job_mutex);
+    workers_stop = 1;
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_mutex);
+    for (i=0; i<nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        close_decoder(&workers[i]);
+    }
+    free(workers);
+    free(jobs);
+    workers = NULL;
+    jobs = NULL;
 }
 
 #ifdef FANCY_RESAMPLING
 static int init_src(void) {
     int err;
-    if (fancy_resampling)
+    if (fancy_resampling) {
         src = src_new(SRC_SINC_MEDIUM_QUALITY, 2, &err);
-    else
+        src_in = malloc(2*frame_size*sizeof(float));
+        src_out = malloc(2*2*frame_size*sizeof(float));
+    } else {
         src = NULL;
+        err = 0;
+    }
 
     return err;
 }
 static void free_src(void) {
     src_delete(src);
     src = NULL;
+    free(src_in);
+    free(src_out);
+    src_in = src_out = NULL;
 }
 #endif
 
-static void init_buffer(void) {
+// slots are cache line aligned so neighbouring frames never share a line
+#define SLOT_ALIGN 64
+#define SLOT_ROUND(bytes) (((bytes) + SLOT_ALIGN-1) & ~(SLOT_ALIGN-1))
+
+// the largest packet the stream can send: the encoder falls back to
+// verbatim samples when compression doesn't pay, plus a header and end
+// tag per element
+static int max_packet_bytes(int32_t fmtp[12]) {
+    int bytes = fmtp[1] * fmtp[7] * fmtp[3] / 8 + 16 * fmtp[7] + 16;
+    if (fmtp[9] > 0 && fmtp[9] < bytes)     // maxFrameBytes, if the source says
+        bytes = fmtp[9];
+    return bytes < MAX_PACKET ? bytes : MAX_PACKET;
+}
+
+static void init_buffer(int32_t fmtp[12]) {
     int i;
-    for (i=0; i<BUFFER_FRAMES; i++)
-        audio_buffer[i].data = malloc(OUTFRAME_BYTES(frame_size));
-    ab_resync();
+    size_t entries = SLOT_ROUND(buffer_frames * sizeof(abuf_t));
+    size_t resend_bytes = SLOT_ROUND(buffer_frames * sizeof(resend_t));
+    size_t size, slot_bytes, frame_bytes = SLOT_ROUND(OUTFRAME_BYTES(frame_size));
+    int pcm_bytes = 0;
+    uint8_t *data;
+
+    // a slot holds decoded audio, the packet as received, or with
+    // workers both
+    if (!config.lazy_decode)
+        pcm_bytes = frame_bytes;
+    packet_bytes = 0;
+    if (config.lazy_decode || nworkers)
+        packet_bytes = SLOT_ROUND(max_packet_bytes(fmtp) + PACKET_PADDING);
+    slot_bytes = pcm_bytes + packet_bytes;
+    // and the player thread's frames for concealment and lazy decoding
+    size = entries + resend_bytes + buffer_frames * slot_bytes + 2 * frame_bytes;
+    if (config.lazy_decode)
+        size += frame_bytes;
+
+    if (posix_memalign(&buffer_mem, SLOT_ALIGN, size))
+        die("could not allocate %zu bytes of jitter buffer", size);
+    audio_buffer = buffer_mem;
+    resends = (void*)((uint8_t*)buffer_mem + entries);
+    data = (uint8_t*)buffer_mem + entries + resend_bytes;
+    for (i=0; i<buffer_frames; i++, data += slot_bytes) {
+        audio_buffer[i].data = pcm_bytes ? data : NULL;
+        audio_buffer[i].packet = packet_bytes ? data + pcm_bytes : NULL;
+    }
+    plc_history = data;
+    plc_frame = data + frame_bytes;
+    lazy_frame = config.lazy_decode ? data + 2 * frame_bytes : NULL;
+    ab_reset();
+
+    debug(1, "jitter buffer: %d frames, %.1f ms, %zu KiB\n",
+          buffer_frames, 1000.0 * buffer_frames * frame_size / sampling_rate,
+          size / 1024);
 }
 
 static void free_buffer(void) {
-    int i;
-    for (i=0; i<BUFFER_FRAMES; i++)
-        free(audio_buffer[i].data);
+    free(buffer_mem);
+    buffer_mem = NULL;
+    audio_buffer = NULL;
+    lazy_frame = NULL;
+    plc_history = plc_frame = NULL;
+    resends = NULL;
 }
 
-void player_put_packet(seq_t seqno, uint8_t *data, int len) {
+void player_put_packet(seq_t seqno, uint32_t timestamp, uint8_t *data, int len) {
     abuf_t *abuf = 0;
-    int16_t buf_fill;
+    uint32_t flushes = atomic_load(&ab_flushes) & 0x7fff;
+    seq_t read, write;
+    int i;
 
-    pthread_mutex_lock(&ab_mutex);
-    if (!ab_synced) {
+    if (!producer_sync || SYNC_FLUSHES(producer_sync) != flushes) {
         debug(2, "syncing to first seqno %04X\n", seqno);
-        ab_write = seqno-1;
-        ab_read = seqno;
-        ab_synced = 1;
+        if (nworkers)
+            decode_wait_idle();
+        for (i=0; i<buffer_frames; i++)
+            atomic_store(&audio_buffer[i].ready, 0);
+        atomic_store(&ab_write, seqno-1);
+        write_timestamp = timestamp - frame_size;
+        producer_sync = SYNC_VALID | flushes << 16 | seqno;
+        atomic_store(&ab_sync, producer_sync);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
     }
-    if (seq_diff(ab_write, seqno) == 1) {                  // expected packet
-        abuf = audio_buffer + BUFIDX(seqno);
-        ab_write = seqno;
-    } else if (seq_order(ab_write, seqno)) {    // newer than expected
-        rtp_request_resend(ab_write+1, seqno-1);
+
+    // until the player thread has caught up with a resync, it will read
+    // from the sync point. it may still be playing a frame from before
+    // the resync though, so leave that slot alone.
+    int busy = -1;
+    uint32_t read_sync = atomic_load(&ab_read_sync);
+    if (read_sync == producer_sync) {
+        read = atomic_load(&ab_read);
+    } else {
+        read = SYNC_SEQNO(producer_sync);
+        if (read_sync)
+            busy = BUFIDX(atomic_load(&ab_read) - 1);
+    }
+    write = ab_write;
+
+    if (seq_order(write, seqno)) {      // the newest, maybe past a gap
+        // the source's clock should advance a frame per packet. the player
+        // thread keeps to the timestamps; this just says why
+        uint32_t expected = write_timestamp + seq_diff(write, seqno) * frame_size;
+        if (timestamp != expected)
+            debug(1, "timestamp discontinuity at %04X: %u, expected %u\n",
+                  seqno, timestamp, expected);
         abuf = audio_buffer + BUFIDX(seqno);
-        ab_write = seqno;
-    } else if (seq_order(ab_read, seqno)) {     // late but not yet played
+        write = seqno;
+        write_timestamp = timestamp;
+    } else if (!seq_order(seqno, read)) {     // late but not yet played
         abuf = audio_buffer + BUFIDX(seqno);
     } else {    // too late.
-        debug(1, "late packet %04X (%04X:%04X)", seqno, ab_read, ab_write);
+        debug(1, "late packet %04X (%04X:%04X)", seqno, read, write);
     }
-    buf_fill = seq_diff(ab_read, ab_write);
-    pthread_mutex_unlock(&ab_mutex);
 
+    if (abuf && seq_diff(read, seqno) >= buffer_frames-1) {
+        // no room; the player thread will skip ahead
+        debug(1, "no room for packet %04X (%04X:%04X)", seqno, read, write);
+        abuf = 0;
+    }
     if (abuf) {
-        alac_decode(abuf->data, data, len);
-        abuf->ready = 1;
+        uint32_t ready = atomic_load(&abuf->ready);
+        if (SLOT_HOLDS(ready, seqno))   // a duplicate
+            abuf = 0;
+        else if (ready & SLOT_PENDING) {
+            // a worker is still on the last lap's packet. keeps it to one
+            // job per slot, so the queue can't overflow
+            debug(1, "dropping packet %04X, its slot is still decoding", seqno);
+            abuf = 0;
+        }
+    }
+    if (abuf && abuf - audio_buffer == busy) {
+        debug(1, "dropping packet %04X, its slot is still playing", seqno);
+        abuf = 0;
     }
 
-    pthread_mutex_lock(&ab_mutex);
-    if (ab_buffering && buf_fill >= config.buffer_start_fill) {
-        debug(1, "buffering over. starting play\n");
-        ab_buffering = 0;
-        bf_est_reset(buf_fill);
+    if (abuf && packet_bytes && len + PACKET_PADDING > packet_bytes) {
+        warn("packet %04X is too big to buffer (%d bytes)", seqno, len);
+        abuf = 0;
+    }
+
+    if (abuf) {
+        abuf->timestamp = timestamp;
+        abuf->arrival = monotonic_ms();
+        if (abuf->packet) {
+            memcpy(abuf->packet, data, len);
+            abuf->len = len;
+        }
+        if (nworkers) {
+            atomic_store(&abuf->ready, seqno | SLOT_PENDING);
+            decode_queue(abuf, seqno);
+        } else {
+            // with lazy_decode, the player thread decodes it just in time
+            if (!config.lazy_decode)
+                abuf->samples = alac_decode(&decoder, abuf->data, data, len);
+            atomic_store(&abuf->ready, seqno | SLOT_READY);
+        }
+    }
+    atomic_store(&ab_write, write);
+}
+
+
+// the soft volume stage, player thread only. 16 bit output is dithered
+// with TPDF noise of +-1 LSB, from DITHER_LANES xorshift generators that
+// take the samples in turn, so the vector code steps them all at once.
+// a gain below unity is even here, which lets the vector code multiply
+// by half of it in 16 bits and double the product.
+#define DITHER_LANES 8
+static uint32_t dither[DITHER_LANES] __attribute__((aligned(16))) = {
+    0x9e3779b9, 0x7f4a7c15, 0x85ebca6b, 0xc2b2ae35,
+    0x27d4eb2f, 0x165667b1, 0xd3a2646c, 0xfd7046c5,
+};
+
+static inline uint32_t xorshift32(uint32_t x) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+#if defined(PLAYER_SSE2)
+static inline __m128i xorshift32_sse2(__m128i x) {
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+    return _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+}
+
+// plus half an LSB, so the shift right rounds
+static inline __m128i tpdf_sse2(__m128i r) {
+    __m128i t = _mm_sub_epi32(_mm_and_si128(r, _mm_set1_epi32(0xffff)),
+                              _mm_srli_epi32(r, 16));
+    return _mm_add_epi32(t, _mm_set1_epi32(0x8000));
+}
+
+static int vol_block16_sse2(short *out, const short *in, int n, int gain) {
+    __m128i g = _mm_set1_epi16(gain >> 1);
+    __m128i r0 = _mm_load_si128((__m128i*)dither);
+    __m128i r1 = _mm_load_si128((__m128i*)dither + 1);
+    int i;
+
+    for (i=0; i+8<=n; i+=8) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i lo = _mm_mullo_epi16(s, g), hi = _mm_mulhi_epi16(s, g);
+        __m128i p0 = _mm_unpacklo_epi16(lo, hi), p1 = _mm_unpackhi_epi16(lo, hi);
+        r0 = xorshift32_sse2(r0);
+        r1 = xorshift32_sse2(r1);
+        p0 = _mm_add_epi32(_mm_add_epi32(p0, p0), tpdf_sse2(r0));
+        p1 = _mm_add_epi32(_mm_add_epi32(p1, p1), tpdf_sse2(r1));
+        _mm_storeu_si128((__m128i*)(out + i),
+                         _mm_packs_epi32(_mm_srai_epi32(p0, 16), _mm_srai_epi32(p1, 16)));
+    }
+    _mm_store_si128((__m128i*)dither, r0);
+    _mm_store_si128((__m128i*)dither + 1, r1);
+    return i;
+}
+#elif defined(PLAYER_NEON)
+static inline uint32x4_t xorshift32_neon(uint32x4_t x) {
+    x = veorq_u32(x, vshlq_n_u32(x, 13));
+    x = veorq_u32(x, vshrq_n_u32(x, 17));
+    return veorq_u32(x, vshlq_n_u32(x, 5));
+}
+
+static inline int32x4_t tpdf_neon(uint32x4_t r) {
+    int32x4_t t = vsubq_s32(vreinterpretq_s32_u32(vandq_u32(r, vdupq_n_u32(0xffff))),
+                            vreinterpretq_s32_u32(vshrq_n_u32(r, 16)));
+    return vaddq_s32(t, vdupq_n_s32(0x8000));
+}
+
+static int vol_block16_neon(short *out, const short *in, int n, int gain) {
+    int16x4_t g = vdup_n_s16(gain >> 1);
+    uint32x4_t r0 = vld1q_u32(dither), r1 = vld1q_u32(dither + 4);
+    int i;
+
+    for (i=0; i+8<=n; i+=8) {
+        int16x8_t s = vld1q_s16(in + i);
+        int32x4_t p0 = vmull_s16(vget_low_s16(s), g);
+        int32x4_t p1 = vmull_s16(vget_high_s16(s), g);
+        r0 = xorshift32_neon(r0);
+        r1 = xorshift32_neon(r1);
+        p0 = vaddq_s32(vaddq_s32(p0, p0), tpdf_neon(r0));
+        p1 = vaddq_s32(vaddq_s32(p1, p1), tpdf_neon(r1));
+        vst1q_s16(out + i, vcombine_s16(vshrn_n_s32(p0, 16), vshrn_n_s32(p1, 16)));
+    }
+    vst1q_u32(dither, r0);
+    vst1q_u32(dither + 4, r1);
+    return i;
+}
+#endif
+
+static inline short dithered_vol(short sample, int gain, int lane) {
+    uint32_t r = dither[lane] = xorshift32(dither[lane]);
+    int32_t tpdf = (int32_t)(r & 0xffff) - (int32_t)(r >> 16);
+    return (sample * (gain & ~1) + tpdf + 0x8000) >> 16;
+}
+
+// n single samples, at a gain below unity. the scalar code finishes
+// what the vector code leaves, on the same lanes
+static void vol_block16(short *out, const short *in, int n, int gain) {
+    int i = 0;
+#if defined(PLAYER_SSE2)
+    i = vol_block16_sse2(out, in, n, gain);
+#elif defined(PLAYER_NEON)
+    i = vol_block16_neon(out, in, n, gain);
+#endif
+    for (; i<n; i++)
+        out[i] = dithered_vol(in[i], gain, i % DITHER_LANES);
+}
+
+// a frame's soft volume: gain is 16.16 fixed point, scaled up by another
+// 16 bits so that step, added after each sample, can ramp it smoothly
+typedef struct {
+    int64_t gain;
+    int64_t step;
+} gain_t;
+
+static inline int gain_unity(gain_t *g) {
+    return !g->step && g->gain == (int64_t)0x10000 << 16;
+}
+
+// copy n samples of all channels at the gain, moving it along if it's
+// ramping. out may be in. 32 bit samples have resolution to spare, no
+// dither needed
+static void vol_copy(void *out, void *in, int n, gain_t *g) {
+    int i, c, k = 0;
+
+    if (g->step) {
+        // ramps are short and rare, the scalar code will do
+        for (i=0; i<n; i++) {
+            int gain = g->gain >> 16;
+            if (gain < 0)
+                gain = 0;
+            for (c=0; c<channels; c++, k++) {
+                if (output_bits == 32)
+                    ((int32_t*)out)[k] = ((int64_t)((int32_t*)in)[k] * gain) >> 16;
+                else if (gain < 0x10000)
+                    ((short*)out)[k] = dithered_vol(((short*)in)[k], gain, k % DITHER_LANES);
+                else
+                    ((short*)out)[k] = ((short*)in)[k];
+            }
+            g->gain += g->step;
+        }
+    } else if (gain_unity(g)) {
+        if (out != in)
+            memcpy(out, in, FRAME_BYTES(n));
+    } else if (output_bits == 32) {
+        int32_t *o = out, *s = in;
+        int gain = g->gain >> 16;
+        for (i=0; i<channels*n; i++)
+            o[i] = ((int64_t)s[i] * gain) >> 16;
+    } else {
+        vol_block16(out, in, channels*n, g->gain >> 16);
+    }
+}
+
+// one sample of all channels, interpolated between in[-1] and in[0]
+static void vol_interp(void *out, void *in, gain_t *g) {
+    int c;
+    if (output_bits == 32) {
+        int32_t *o = out, *s = in;
+        for (c=0; c<channels; c++)
+            o[c] = ((int64_t)s[c-channels] + s[c]) >> 1;
+    } else {
+        short *o = out, *s = in;
+        for (c=0; c<channels; c++)
+            o[c] = ((long)s[c-channels] + (long)s[c]) >> 1;
     }
-    pthread_mutex_unlock(&ab_mutex);
+    vol_copy(out, out, 1, g);
 }
 
+// volume changes, player thread only. the soft volume follows
+// fix_volume linearly in dB over config.volume_ramp ms (one frame at
+// least), and linearly within each frame. a mute fades down to
+// VOL_FLOOR_DB first; once it's silent, vol_muted lets the player skip
+// the work of making sound no one will hear.
+#define VOL_FLOOR_DB -96.0
+static int vol_target = 0x10000;    // the fix_volume being ramped to
+static double vol_db;               // where the ramp has got to
+static double vol_step_db;          // per frame; 0 once it's there
+static int vol_muted;
+
+static double gain_db(int gain) {
+    double db = gain > 0 ? 20.0 * log10(gain / 65536.0) : VOL_FLOOR_DB;
+    return db < VOL_FLOOR_DB ? VOL_FLOOR_DB : db;
+}
 
-static short lcg_rand(void) {
-	static unsigned long lcg_prev = 12345;
-	lcg_prev = lcg_prev * 69069 + 3;
-	return lcg_prev & 0xffff;
+static int db_gain(double db) {
+    return db <= VOL_FLOOR_DB ? 0 : 65536.0 * pow(10.0, db / 20.0) + 0.5;
 }
 
-static inline short dithered_vol(short sample) {
-    static short rand_a, rand_b;
-    long out;
+// the gain for the next frame of the given length
+static void vol_frame(gain_t *g, int samples) {
+    int target = atomic_load(&fix_volume);
+    double target_db = gain_db(target), next_db;
+    int g0, g1;
+
+    if (target != vol_target) {
+        double frames = config.volume_ramp / 1000.0 * sampling_rate / frame_size;
+        vol_target = target;
+        vol_step_db = (target_db - vol_db) / (frames < 1.0 ? 1.0 : frames);
+        if (vol_step_db == 0.0)     // a step too small to hear in dB
+            vol_db = target_db;
+    }
+
+    if (vol_step_db == 0.0) {
+        g->gain = (int64_t)target << 16;
+        g->step = 0;
+        vol_muted = !target;
+        return;
+    }
 
-    out = (long)sample * fix_volume;
-    if (fix_volume < 0x10000) {
-        rand_b = rand_a;
-        rand_a = lcg_rand();
-        out += rand_a;
-        out -= rand_b;
+    vol_muted = 0;
+    g0 = db_gain(vol_db);
+    next_db = vol_db + vol_step_db;
+    if (vol_step_db > 0.0 ? next_db >= target_db : next_db <= target_db) {
+        g1 = target;
+        vol_db = target_db;
+        vol_step_db = 0.0;
+    } else {
+        g1 = db_gain(next_db);
+        vol_db = next_db;
     }
-    return out>>16;
+    g->gain = (int64_t)g0 << 16;
+    g->step = ((int64_t)(g1 - g0) << 16) / samples;
 }
 
 typedef struct {
@@ -286,6 +838,10 @@ static double biquad_filt(biquad_t *bq, double in) {
 }
 
 static double bf_playback_rate = 1.0;
+// from clock recovery, once it has a say; see clock_played_frame
+static double clock_drift;
+static int clock_valid;
+#define CLOCK_DECAY 0.999       // per frame, for bf_est_drift after that
 
 static double bf_est_drift = 0.0;   // local clock is slower by
 static biquad_t bf_drift_lpf;
@@ -299,7 +855,7 @@ static void bf_est_reset(short fill) {
     biquad_lpf(&bf_err_lpf, 1.0/10.0, 0.25);
     biquad_lpf(&bf_err_deriv_lpf, 1.0/2.0, 0.2);
     fill_count = 0;
-    bf_playback_rate = 1.0;
+    bf_playback_rate = 1.0 + clock_drift;
     bf_est_err = bf_last_err = 0;
     desired_fill = fill_count = 0;
 }
@@ -329,154 +885,753 @@ static void bf_est_update(short fill) {
     double err_deriv = biquad_filt(&bf_err_deriv_lpf, bf_est_err - bf_last_err);
     double adj_error = CONTROL_A * bf_est_err;
 
-    bf_est_drift = biquad_filt(&bf_drift_lpf, CONTROL_B*(adj_error + err_deriv) + bf_est_drift);
+    if (clock_valid)    // the clocks know better; let what we had fade
+        bf_est_drift *= CLOCK_DECAY;
+    else
+        bf_est_drift = biquad_filt(&bf_drift_lpf, CONTROL_B*(adj_error + err_deriv) + bf_est_drift);
 
     debug(3, "bf %d err %f drift %f desiring %f ed %f estd %f\n",
           fill, bf_est_err, bf_est_drift, desired_fill, err_deriv, err_deriv + adj_error);
-    bf_playback_rate = 1.0 + adj_error + bf_est_drift;
+    bf_playback_rate = 1.0 + adj_error + bf_est_drift + clock_drift;
 
     bf_last_err = bf_est_err;
 }
 
-// get the next frame, when available. return 0 if underrun/stream reset.
-static short *buffer_get_frame(void) {
-    int16_t buf_fill;
-    seq_t read, next;
-    abuf_t *abuf = 0;
-    int i;
+// clock recovery. the RTP thread puts the source's timestamps on our
+// monotonic clock, from its sync packets and the timing exchange, and
+// the player thread does the same for the samples it has handed to the
+// output. a line through each gives the two sample rates by our clock,
+// and their ratio is the drift. once both lines are long enough it takes
+// over from bf_est_drift, leaving the fill controller to hold the fill.
+#define CLOCK_MIN_SPAN 120.0    // seconds of points before a line counts
+#define CLOCK_FORGET 0.999      // per point, about a second apart
+#define CLOCK_MAX_DRIFT 1e-3    // beyond this something else is going on
+
+typedef struct {    // least squares, weighted towards recent points
+    int n;
+    double t0, y0;  // the first point; the sums are relative to it
+    double t;       // the last point's
+    double w, st, sy, stt, sty;
+} clock_fit_t;
+
+static pthread_mutex_t clock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int clock_running;
+static clock_fit_t clock_source;        // under clock_mutex
+static uint32_t clock_source_last;
+static double clock_source_y;           // clock_source_last, unwrapped
+static clock_fit_t clock_output;        // player thread only
+static int64_t clock_played;
+static double clock_output_last;
+
+static void clock_fit_add(clock_fit_t *f, double t, double y) {
+    if (!f->n++) {
+        f->t0 = t;
+        f->y0 = y;
+    }
+    t -= f->t0;
+    y -= f->y0;
+    f->t = t;
+    f->w = f->w * CLOCK_FORGET + 1.0;
+    f->st = f->st * CLOCK_FORGET + t;
+    f->sy = f->sy * CLOCK_FORGET + y;
+    f->stt = f->stt * CLOCK_FORGET + t*t;
+    f->sty = f->sty * CLOCK_FORGET + t*y;
+}
 
-    if (ab_buffering)
+// samples per second, by our clock
+static int clock_fit_rate(clock_fit_t *f, double *rate) {
+    double d = f->w * f->stt - f->st * f->st;
+    if (f->t < CLOCK_MIN_SPAN || d <= 0.0)
         return 0;
+    *rate = (f->w * f->sty - f->st * f->sy) / d;
+    return 1;
+}
 
-    pthread_mutex_lock(&ab_mutex);
+static void clock_reset(void) {
+    pthread_mutex_lock(&clock_mutex);
+    memset(&clock_source, 0, sizeof(clock_source));
+    pthread_mutex_unlock(&clock_mutex);
+    memset(&clock_output, 0, sizeof(clock_output));
+    clock_played = 0;
+    clock_output_last = monotonic_seconds();
+    clock_drift = 0.0;
+    clock_valid = 0;
+}
 
-    buf_fill = seq_diff(ab_read, ab_write);
-    if (buf_fill < 1 || !ab_synced) {
-        if (buf_fill < 1)
-            warn("underrun.");
-        ab_buffering = 1;
-        pthread_mutex_unlock(&ab_mutex);
-        return 0;
+void player_clock_sync(uint32_t timestamp, uint64_t local_time) {
+    double t = local_time / 4294967296.0;
+
+    pthread_mutex_lock(&clock_mutex);
+    if (clock_running) {
+        clock_fit_t *f = &clock_source;
+        if (f->n) {
+            // unwrap the timestamp. if it doesn't follow on from the
+            // last one, the source has skipped: start the line again
+            int32_t ahead = timestamp - clock_source_last;
+            double expect = (t - f->t0 - f->t) * sampling_rate;
+            if (fabs(ahead - expect) > sampling_rate / 10) {
+                debug(2, "clock: source timeline moved by %.0f samples\n", ahead - expect);
+                memset(f, 0, sizeof(*f));
+            } else {
+                clock_source_y += ahead;
+                clock_fit_add(f, t, clock_source_y);
+            }
+        }
+        if (!f->n) {
+            clock_source_y = 0.0;
+            clock_fit_add(f, t, 0.0);
+        }
+        clock_source_last = timestamp;
     }
-    if (buf_fill >= BUFFER_FRAMES) {   // overrunning! uh-oh. restart at a sane distance
-        warn("overrun.");
-        ab_read = ab_write - config.buffer_start_fill;
+    pthread_mutex_unlock(&clock_mutex);
+}
+
+// player thread, after each frame goes to the output
+static void clock_played_frame(int samples) {
+    double now = monotonic_seconds();
+    double source_rate, output_rate, drift;
+    int have_source;
+
+    clock_played += samples;
+    if (now - clock_output_last < 1.0)
+        return;
+    clock_output_last = now;
+    clock_fit_add(&clock_output, now, clock_played);
+
+    pthread_mutex_lock(&clock_mutex);
+    have_source = clock_fit_rate(&clock_source, &source_rate);
+    pthread_mutex_unlock(&clock_mutex);
+    if (!have_source || !clock_fit_rate(&clock_output, &output_rate))
+        return;
+
+    drift = source_rate / output_rate - 1.0;
+    if (fabs(drift) > CLOCK_MAX_DRIFT) {
+        debug(2, "clock: ignoring drift of %.0f ppm\n", drift * 1e6);
+        return;
     }
-    read = ab_read;
-    ab_read++;
-    buf_fill = seq_diff(ab_read, ab_write);
-    bf_est_update(buf_fill);
+    if (!clock_valid) {
+        debug(1, "clock: source %.2f Hz, output %.2f Hz by our clock; "
+              "drift %.1f ppm, was %.1f from the fill\n", source_rate,
+              output_rate, drift * 1e6, bf_est_drift * 1e6);
+        // hand over without a jump in the rate
+        bf_est_drift -= drift;
+        clock_valid = 1;
+    }
+    bf_playback_rate += drift - clock_drift;
+    clock_drift = drift;
+}
+
+// packet loss concealment, player thread only. a missing frame is
+// replaced by repeating the last pitch period of the frame before it,
+// eased in over PLC_JOIN samples and faded out over PLC_FADE_FRAMES. if
+// the frame after it is already in the ring, the gap is crossfaded into
+// that frame's first period repeated backwards, which then plays as is.
+// otherwise the next frame that arrives is crossfaded in over PLC_XFADE
+// samples, or faded in if it had gone silent. an underrun fades out the
+// same way.
+//
+// the last good frame is only copied to plc_history when a loss follows
+// it, while its slot is still ours: see conceal_keep.
+#define PLC_FADE_FRAMES 3
+#define PLC_XFADE 64
+#define PLC_JOIN 16
+#define PLC_MATCH 64        // samples compared to find the period
+#define PLC_MIN_PERIOD 32
+static void *plc_prev;              // the last good frame, while we have it
+static int plc_prev_samples;
+static int plc_history_samples;     // 0 if there is nothing to go on
+static int plc_period, plc_phase, plc_lost, plc_joined;
+static long plc_concealed, plc_bursts;  // frames lost, and runs of them
+static long plc_refill;     // frames played while refilling after an underrun
+
+static inline int32_t plc_get(void *buf, int i) {
+    return output_bits == 32 ? ((int32_t*)buf)[i] : ((short*)buf)[i];
+}
+
+static inline void plc_put(void *buf, int i, double v) {
+    if (output_bits == 32) {
+        ((int32_t*)buf)[i] = v > INT32_MAX ? INT32_MAX : v < INT32_MIN ? INT32_MIN : v;
+    } else {
+        ((short*)buf)[i] = v > SHRT_MAX ? SHRT_MAX : v < SHRT_MIN ? SHRT_MIN : v;
+    }
+}
 
-    // check if t+16, t+32, t+64, t+128, ... (buffer_start_fill / 2)
-    // packets have arrived... last-chance resend
-    if (!ab_buffering) {
-        for (i = 16; i < (config.buffer_start_fill / 2); i = (i * 2)) {
-            next = ab_read + i;
-            abuf = audio_buffer + BUFIDX(next);
-            if (!abuf->ready) {
-                rtp_request_resend(next, next);
+// the last good frame's slot is about to go back to the producer, and
+// concealment will need it
+static void conceal_keep(void) {
+    if (!plc_prev)
+        return;
+    plc_history_samples = plc_prev_samples;
+    memcpy(plc_history, plc_prev, FRAME_BYTES(plc_prev_samples));
+    plc_prev = NULL;
+}
+
+// the lag that best continues the end of the history, on a mono mix
+static int plc_find_period(void) {
+    int n = plc_history_samples, best = n, lag, i, c;
+    double best_score = 0.0;
+
+    for (lag = PLC_MIN_PERIOD; lag <= n - PLC_MATCH; lag++) {
+        double xy = 0.0, yy = 0.0;
+        for (i = n - PLC_MATCH; i < n; i++) {
+            double x = 0.0, y = 0.0;
+            for (c = 0; c < channels; c++) {
+                x += plc_get(plc_history, i*channels + c);
+                y += plc_get(plc_history, (i-lag)*channels + c);
             }
+            xy += x * y;
+            yy += y * y;
+        }
+        if (yy > 0.0 && xy > 0.0 && xy * xy / yy > best_score) {
+            best_score = xy * xy / yy;
+            best = lag;
         }
     }
+    return best;
+}
 
-    abuf_t *curframe = audio_buffer + BUFIDX(read);
-    if (!curframe->ready) {
-        debug(1, "missing frame %04X.", read);
-        memset(curframe->data, 0, FRAME_BYTES(frame_size));
+// the history's last period, repeated from where the last call left off
+static double plc_extend(int i, int c) {
+    int n = plc_history_samples;
+    int s = n - plc_period + (plc_phase + i) % plc_period;
+    return plc_get(plc_history, s*channels + c);
+}
+
+// the first period of next, repeated backwards from i == frame_size,
+// and eased into its first sample over the last PLC_JOIN
+static double plc_extend_back(void *next, int i, int c) {
+    int s = (i - frame_size) % plc_period;
+    double v = plc_get(next, (s < 0 ? s + plc_period : s)*channels + c);
+    if (i >= frame_size - PLC_JOIN) {
+        double w = (double)(frame_size - i) / (PLC_JOIN+1);
+        v = w * v + (1.0 - w) * plc_get(next, c);
+    }
+    return v;
+}
+
+// next is the frame that will play after this one, if it is already
+// here, else NULL. lost is 0 for a frame played while the buffer
+// refills, which nothing was lost from
+static void *conceal_frame(void *next, int next_samples, int lost) {
+    int n, i, c, forward;
+    double g0, g1;
+
+    if (!lost) {
+        plc_refill++;
+    } else {
+        plc_concealed++;
+        if (!plc_lost)
+            plc_bursts++;
+    }
+    plc_lost++;
+    conceal_keep();
+    n = plc_history_samples;
+    if (n && plc_lost == 1) {
+        plc_period = plc_find_period();
+        plc_phase = 0;
+    }
+    forward = n && plc_lost <= PLC_FADE_FRAMES;
+    if (!n || next_samples < plc_period)
+        next = NULL;
+    if (!forward && !next) {
+        memset(plc_frame, 0, FRAME_BYTES(frame_size));
+        return plc_frame;
+    }
+
+    g0 = forward ? 1.0 - (double)(plc_lost-1) / PLC_FADE_FRAMES : 0.0;
+    // heading into real audio, so hold the level rather than fade
+    g1 = forward && !next ? 1.0 - (double)plc_lost / PLC_FADE_FRAMES : g0;
+    for (i = 0; i < frame_size; i++) {
+        double g = g0 + (g1 - g0) * i / frame_size;
+        double w = (double)(i+1) / (frame_size+1);
+        for (c = 0; c < channels; c++) {
+            double v = g ? g * plc_extend(i, c) : 0.0;
+            // ease away from the last sample played, rather than jump
+            if (g && plc_lost == 1 && i < PLC_JOIN) {
+                double j = (double)(i+1) / (PLC_JOIN+1);
+                v = j * v + (1.0 - j) * plc_get(plc_history, (n-1)*channels + c);
+            }
+            if (next)
+                v = (1.0 - w) * v + w * plc_extend_back(next, i, c);
+            plc_put(plc_frame, i*channels + c, v);
+        }
     }
-    curframe->ready = 0;
-    pthread_mutex_unlock(&ab_mutex);
+    plc_phase = (plc_phase + frame_size) % plc_period;
+    plc_joined = next != NULL;
+    return plc_frame;
+}
 
-    return curframe->data;
+// a frame arrived: blend it in after a loss, and keep it for next time.
+// it stays in its slot until the next frame is claimed
+static void conceal_good_frame(void *data, int samples) {
+    int i, c;
+
+    if (plc_lost && !plc_joined) {
+        // from silence, if concealment had faded out, this is a fade in
+        double g = 1.0 - (double)plc_lost / PLC_FADE_FRAMES;
+        int xfade = samples < PLC_XFADE ? samples : PLC_XFADE;
+        if (!plc_history_samples || g < 0.0)
+            g = 0.0;
+        for (i = 0; i < xfade; i++) {
+            double w = (double)(i+1) / (xfade+1);
+            for (c = 0; c < channels; c++)
+                plc_put(data, i*channels + c,
+                        w * plc_get(data, i*channels + c) +
+                        (g ? (1.0 - w) * g * plc_extend(i, c) : 0.0));
+        }
+    }
+    plc_lost = plc_joined = 0;
+
+    plc_prev = data;
+    plc_prev_samples = samples;
 }
 
-static int stuff_buffer(double playback_rate, short *inptr, short *outptr) {
-    int i;
-    int stuffsamp = frame_size;
-    int stuff = 0;
-    double p_stuff;
+static void conceal_reset(void) {
+    plc_prev = NULL;
+    plc_history_samples = 0;
+    plc_lost = plc_joined = 0;
+}
+
+// resend scheduling. each frame, the player thread looks over what is
+// missing between the read and write points, and asks for it again once
+// the last request has had a round trip to come back, as long as there
+// is a round trip left before the frame is due to play. adjacent frames
+// go out as one request, and each tick asks for at most
+// RESEND_MAX_PER_TICK frames.
+#define RESEND_MAX_TRIES 4
+#define RESEND_MAX_PER_TICK 32
+#define RESEND_MIN_RTO 10   // ms
+static int resend_srtt = 40, resend_rttvar = 20;    // ms, smoothed as TCP does
+static long resend_requests, resend_frames, resend_recovered;
+
+static void resend_rtt_sample(int rtt) {
+    int err = rtt - resend_srtt;
+    resend_srtt += err / 8;
+    resend_rttvar += ((err < 0 ? -err : err) - resend_rttvar) / 4;
+}
+
+static void resend_tick(seq_t read, seq_t write) {
+    uint32_t now = monotonic_ms();
+    double frame_ms = 1000.0 * frame_size / sampling_rate;
+    int rto = resend_srtt + 4 * resend_rttvar;
+    int budget = RESEND_MAX_PER_TICK, run = 0;
+    seq_t s, first = 0;
+
+    if (rto < RESEND_MIN_RTO)
+        rto = RESEND_MIN_RTO;
+
+    for (s = read; seq_order(s, write); s++) {
+        abuf_t *abuf = audio_buffer + BUFIDX(s);
+        resend_t *r = resends + BUFIDX(s);
+        uint32_t ready = atomic_load(&abuf->ready);
+        int due = 0;
+
+        if (r->seqno != s) {
+            r->seqno = s;
+            r->tries = 0;
+            r->resent = 0;
+        }
+        if (SLOT_HOLDS(ready, s)) {
+            if (r->tries) {
+                // only an unambiguous answer says how long a round trip is
+                if (r->tries == 1)
+                    resend_rtt_sample(abuf->arrival - r->sent);
+                resend_recovered++;
+                r->tries = 0;
+                r->resent = 1;
+            }
+        } else if (budget) {
+            int deadline = seq_diff(read, s) * frame_ms;
+            if (!r->tries)
+                due = 1;
+            else if (r->tries < RESEND_MAX_TRIES)
+                due = (int)(now - r->sent) >= rto && deadline > resend_srtt;
+        }
+
+        if (due) {
+            r->tries++;
+            r->sent = now;
+            budget--;
+            if (!run++)
+                first = s;
+        } else if (run) {
+            rtp_request_resend(first, first + run - 1);
+            resend_requests++;
+            resend_frames += run;
+            run = 0;
+        }
+    }
+    if (run) {
+        rtp_request_resend(first, first + run - 1);
+        resend_requests++;
+        resend_frames += run;
+    }
+}
+
+// adaptive target fill, with config.adaptive_fill. the player thread
+// tracks the jitter of packet arrivals against their timestamps, as RFC
+// 3550 does, and how often frames are lost first time round. desired_fill
+// then follows what it takes to ride those out, between
+// config.adaptive_fill and buffer_start_fill: up quickly, down slowly.
+#define ADAPT_UP 0.1        // frames per frame
+#define ADAPT_DOWN 0.01
+static double adapt_jitter;     // ms
+static double adapt_loss;       // fraction of frames
+static uint32_t adapt_last_arrival, adapt_last_timestamp;
+static int adapt_last_valid;
+static long adapt_frames;
+
+static void adapt_reset(void) {
+    adapt_jitter = adapt_loss = 0.0;
+    adapt_last_valid = 0;
+    adapt_frames = 0;
+}
+
+static void adapt_update(abuf_t *frame, int lost) {
+    double frame_ms = 1000.0 * frame_size / sampling_rate;
+    double need_ms, target;
+
+    adapt_loss += ((lost ? 1.0 : 0.0) - adapt_loss) / 256.0;
+    if (lost) {
+        adapt_last_valid = 0;
+    } else {
+        if (adapt_last_valid) {
+            double d = (int32_t)(frame->arrival - adapt_last_arrival) -
+                (int32_t)(frame->timestamp - adapt_last_timestamp) * 1000.0 / sampling_rate;
+            adapt_jitter += (fabs(d) - adapt_jitter) / 16.0;
+        }
+        adapt_last_arrival = frame->arrival;
+        adapt_last_timestamp = frame->timestamp;
+        adapt_last_valid = 1;
+    }
+
+    // leave desired_fill alone until bf_est_update has settled on it
+    if (!config.adaptive_fill || fill_count <= 1000)
+        return;
+
+    need_ms = 4.0 * adapt_jitter;
+    if (adapt_loss > 0.001)     // time for a resend to come back
+        need_ms += 2 * resend_srtt + 4 * resend_rttvar;
+    target = need_ms / frame_ms + 2.0;
+    if (target < config.adaptive_fill)
+        target = config.adaptive_fill;
+    if (target > config.buffer_start_fill)
+        target = config.buffer_start_fill;
+
+    if (target > desired_fill)
+        desired_fill = fmin(target, desired_fill + ADAPT_UP);
+    else
+        desired_fill = fmax(target, desired_fill - ADAPT_DOWN);
+
+    if (++adapt_frames % 1000 == 0)
+        debug(1, "target fill %.1f frames: jitter %.1f ms, loss %.2f%%\n",
+              desired_fill, adapt_jitter, 100.0 * adapt_loss);
+}
+
+// the drift correction carries a few samples and a phase from one frame
+// to the next; start it over where the audio doesn't follow on
+static void drift_reset(void) {
+#ifdef FANCY_RESAMPLING
+    if (fancy_resampling)
+        src_reset(src);
+#endif
+    if (resample_state)
+        resampler_reset(resample_state);
+}
+
+// get the next frame, when available. return 0 if underrun/stream reset
+// or the frame is missing; play *samples of silence then. *gap is set to
+// the silence to play before the frame, if there is a hole in the
+// source's timeline.
+static void *buffer_get_frame(int *samples, int *gap) {
+    uint32_t flushes = atomic_load(&ab_flushes) & 0x7fff;
+    uint32_t sync = atomic_load(&ab_sync);
+    int16_t buf_fill;
+    seq_t read, write;
+    abuf_t *curframe;
+    void *data;
+    int32_t ahead;
+
+    *samples = frame_size;
+    *gap = 0;
+
+    if (sync != consumer_sync) {    // the producer has resynced
+        consumer_sync = sync;
+        atomic_store(&ab_read, SYNC_SEQNO(sync));
+        atomic_store(&ab_read_sync, sync);
+        ab_buffering = BUFFERING_START;
+        memset(resends, 0, buffer_frames * sizeof(resend_t));
+    }
+    if (!consumer_sync || SYNC_FLUSHES(consumer_sync) != flushes) {
+        // flushed; wait for the producer to resync
+        ab_buffering = BUFFERING_START;
+        return 0;
+    }
+
+    read = ab_read;
+    write = atomic_load(&ab_write);
+    buf_fill = seq_diff(read, write);
+
+    resend_tick(read, write);
+
+    if (ab_buffering == BUFFERING_START) {
+        if (buf_fill < config.buffer_start_fill)
+            return 0;
+        debug(1, "buffering over. starting play\n");
+        ab_buffering = 0;
+        play_timestamp_valid = 0;
+        conceal_reset();
+        drift_reset();
+        bf_est_reset(buf_fill);
+        adapt_last_valid = 0;
+    } else if (ab_buffering == BUFFERING_REFILL) {
+        // fade out what was playing rather than cut it off
+        if (buf_fill < config.buffer_refill)
+            return conceal_frame(NULL, 0, 0);
+        debug(1, "refilled to %d frames. resuming play\n", buf_fill);
+        ab_buffering = 0;
+    }
 
-    p_stuff = 1.0 - pow(1.0 - fabs(playback_rate-1.0), frame_size);
+    if (buf_fill < 1) {
+        warn("underrun.");
+        ab_buffering = BUFFERING_REFILL;
+        return conceal_frame(NULL, 0, 0);
+    }
+    if (buf_fill >= buffer_frames-1) {   // overrunning! uh-oh. restart at a sane distance
+        warn("overrun.");
+        read = write - config.buffer_start_fill;
+        plc_joined = 0;     // that wasn't the next frame after all
+        // nor is the frame we skipped to: don't pad the jump with silence
+        play_timestamp_valid = 0;
+    }
+    // claim the frame. the producer won't touch its slot until we've
+    // claimed the next one
+    curframe = audio_buffer + BUFIDX(read);
+    // the last frame's slot is the producer's once this one is claimed
+    if (atomic_load(&curframe->ready) != (read | SLOT_READY))
+        conceal_keep();
+    atomic_store(&ab_read, (seq_t)(read+1));
+    // pairs with the fence after a resync in player_put_packet: either
+    // the producer sees this claim, or we see its resync and back off
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (atomic_load(&ab_sync) != consumer_sync)
+        return 0;
+    buf_fill = seq_diff(read+1, write);
+    bf_est_update(buf_fill);
 
-    if (rand() < p_stuff * RAND_MAX) {
-        stuff = playback_rate > 1.0 ? -1 : 1;
-        stuffsamp = rand() % (frame_size - 1);
+    if (atomic_load(&curframe->ready) != (read | SLOT_READY)) {
+        abuf_t *next = audio_buffer + BUFIDX(read+1);
+        debug(1, "missing frame %04X.", read);
+        adapt_update(curframe, 1);
+        play_timestamp += frame_size;
+        // the frame after it may be here already: decoded, on time, and
+        // not written to again until the resync that would flush it
+        if (next->data &&
+            atomic_load(&next->ready) == ((seq_t)(read+1) | SLOT_READY) &&
+            play_timestamp_valid && next->timestamp == play_timestamp)
+            return conceal_frame(next->data, next->samples, 1);
+        return conceal_frame(NULL, 0, 1);
+    }
+    adapt_update(curframe, resends[BUFIDX(read)].seqno == read &&
+                           resends[BUFIDX(read)].resent);
+    if (config.lazy_decode && vol_muted) {
+        // no one will hear it, so don't decrypt or decode it
+        memset(lazy_frame, 0, FRAME_BYTES(frame_size));
+        data = lazy_frame;
+    } else if (config.lazy_decode) {
+        // the slot is ours until the next call, so decrypt it in place
+        *samples = alac_decode(&decoder, lazy_frame, curframe->packet, curframe->len);
+        data = lazy_frame;
+    } else {
+        *samples = curframe->samples;
+        data = curframe->data;
     }
 
-    pthread_mutex_lock(&vol_mutex);
-    for (i=0; i<stuffsamp; i++) {   // the whole frame, if no stuffing
-        *outptr++ = dithered_vol(*inptr++);
-        *outptr++ = dithered_vol(*inptr++);
-    };
+    // keep to the source's timeline: if it skips ahead, play silence to
+    // keep the frames after the hole on time. anything else re-anchors it.
+    ahead = curframe->timestamp - play_timestamp;
+    if (play_timestamp_valid && ahead > 0 && ahead <= sampling_rate) {
+        debug(1, "timeline gap of %d samples before %04X\n", ahead, read);
+        *gap = ahead;
+    } else if (play_timestamp_valid && ahead) {
+        debug(1, "timeline jump of %d samples at %04X\n", ahead, read);
+    }
+    play_timestamp = curframe->timestamp + *samples;
+    play_timestamp_valid = 1;
+
+    // the slot is ours until the next call, so crossfade in place
+    conceal_good_frame(data, *samples);
+
+    return data;
+}
+
+// whether to add (1) or drop (-1) a sample in this frame, and where
+static int stuff_pick(double playback_rate, int samples, int *stuffsamp) {
+    double p_stuff = 1.0 - pow(1.0 - fabs(playback_rate-1.0), samples);
+
+    *stuffsamp = samples;
+    if (samples > 2 && rand() < p_stuff * RAND_MAX) {
+        // at least one sample in, so interpolation stays inside the frame
+        *stuffsamp = 1 + rand() % (samples - 1);
+        return playback_rate > 1.0 ? -1 : 1;
+    }
+    return 0;
+}
+
+// returns the number of samples to play from *outbuf. that is inbuf
+// itself, uncopied, when the frame goes out as it is: no stuffing, and
+// unity soft volume (which is always so with a hardware mixer)
+static int stuff_buffer(double playback_rate, gain_t *gain,
+                        void *inbuf, void **outbuf, int samples) {
+    char *inptr = inbuf, *outptr = *outbuf;
+    int bytes = FRAME_BYTES(1);
+    int stuffsamp;
+    int stuff = stuff_pick(playback_rate, samples, &stuffsamp);
+
+    if (!stuff && gain_unity(gain)) {
+        *outbuf = inbuf;
+        return samples;
+    }
+    vol_copy(outptr, inptr, stuffsamp, gain);   // the whole frame, if no stuffing
+    inptr += stuffsamp * bytes;
+    outptr += stuffsamp * bytes;
     if (stuff) {
+        int rest = samples - stuffsamp;
         if (stuff==1) {
             debug(2, "+++++++++\n");
             // interpolate one sample
-            *outptr++ = dithered_vol(((long)inptr[-2] + (long)inptr[0]) >> 1);
-            *outptr++ = dithered_vol(((long)inptr[-1] + (long)inptr[1]) >> 1);
+            vol_interp(outptr, inptr, gain);
+            outptr += bytes;
         } else if (stuff==-1) {
             debug(2, "---------\n");
-            inptr++;
-            inptr++;
-        }
-        for (i=stuffsamp; i<frame_size + stuff; i++) {
-            *outptr++ = dithered_vol(*inptr++);
-            *outptr++ = dithered_vol(*inptr++);
+            inptr += bytes;
+            rest--;
         }
+        vol_copy(outptr, inptr, rest, gain);
     }
-    pthread_mutex_unlock(&vol_mutex);
 
-    return frame_size + stuff;
+    return samples + stuff;
 }
 
-static void *player_thread_func(void *arg) {
-    int play_samples;
+// drift correction with the resampler rather than stuffing. the volume
+// goes on afterwards, in place, so the resampler never sees the dither
+// (but for lazily decoded frames, which the decoder has already scaled)
+static int resample_buffer(double playback_rate, gain_t *gain,
+                           void *inbuf, void *outbuf, int samples) {
+    int play_samples = resampler_process(resample_state, inbuf, samples, outbuf,
+                                         playback_rate);
 
-    signed short *inbuf, *outbuf, *silence;
-    outbuf = malloc(OUTFRAME_BYTES(frame_size));
-    silence = malloc(OUTFRAME_BYTES(frame_size));
-    memset(silence, 0, OUTFRAME_BYTES(frame_size));
+    vol_copy(outbuf, outbuf, play_samples, gain);
+
+    return play_samples;
+}
 
 #ifdef FANCY_RESAMPLING
-    float *frame, *outframe;
+// the same with libsamplerate, which is 16 bit stereo only here. the
+// volume is folded into the conversion to float
+static int fancy_buffer(double playback_rate, gain_t *gain,
+                        void *inbuf, void *outbuf, int samples) {
     SRC_DATA srcdat;
-    if (fancy_resampling) {
-        frame = malloc(frame_size*2*sizeof(float));
-        outframe = malloc(2*frame_size*2*sizeof(float));
 
-        srcdat.data_in = frame;
-        srcdat.data_out = outframe;
-        srcdat.input_frames = FRAME_BYTES(frame_size);
-        srcdat.output_frames = 2*FRAME_BYTES(frame_size);
-        srcdat.src_ratio = 1.0;
-        srcdat.end_of_input = 0;
-    }
+    resample_stereo_to_float(inbuf, src_in, samples,
+                             gain->gain / (65536.0 * 65536.0 * 32768.0),
+                             gain->step / (65536.0 * 65536.0 * 32768.0));
+
+    srcdat.data_in = src_in;
+    srcdat.data_out = src_out;
+    srcdat.input_frames = samples;
+    srcdat.output_frames = 2*frame_size;
+    // output samples per input sample, so the inverse of ours
+    srcdat.src_ratio = 1.0 / playback_rate;
+    srcdat.end_of_input = 0;
+    src_process(src, &srcdat);
+    assert(srcdat.input_frames_used == samples);
+    resample_float_to_s16(src_out, outbuf, 2*srcdat.output_frames_gen);
+
+    return srcdat.output_frames_gen;
+}
+#endif
+
+static void *player_thread_func(void *arg) {
+    int play_samples, samples, gap = 0;
+    gain_t gain;
+
+    void *inbuf, *outbuf, *playbuf, *silence, *held = NULL;
+    int held_samples = 0, muted = 0;
+    // room for whatever drift correction makes of a frame
+    int out_samples = frame_size + 3;
+    if (resample_state)
+        out_samples = RESAMPLE_MAX_OUT(frame_size);
+#ifdef FANCY_RESAMPLING
+    if (fancy_resampling)
+        out_samples = 2*frame_size;
 #endif
+    outbuf = malloc(FRAME_BYTES(out_samples));
+    silence = malloc(OUTFRAME_BYTES(frame_size));
+    memset(silence, 0, OUTFRAME_BYTES(frame_size));
 
     while (!please_stop) {
-        inbuf = buffer_get_frame();
-        if (!inbuf)
+        playbuf = outbuf;
+        if (gap) {
+            // a hole in the source's timeline, then the frame after it
+            samples = gap < frame_size ? gap : frame_size;
+            gap -= samples;
             inbuf = silence;
-
-#ifdef FANCY_RESAMPLING
-        if (fancy_resampling) {
-            int i;
-            pthread_mutex_lock(&vol_mutex);
-            for (i=0; i<2*FRAME_BYTES(frame_size); i++) {
-                frame[i] = (float)inbuf[i] / 32768.0;
-                frame[i] *= volume;
+        } else if (held) {
+            inbuf = held;
+            samples = held_samples;
+            held = NULL;
+        } else {
+            if (config.lazy_decode) {
+                // the decoder applies the volume as it writes the frame.
+                // all else that comes out of the buffer is made from such
+                // frames, or is silence, so the volume stage below has
+                // nothing left to do. frames are frame_size samples, bar
+                // the odd short one, which just ramps a little less
+                vol_frame(&gain, frame_size);
+                alac_set_gain(decoder.alac, gain.gain, gain.step);
             }
-            pthread_mutex_unlock(&vol_mutex);
-            srcdat.src_ratio = bf_playback_rate;
-            src_process(src, &srcdat);
-            assert(srcdat.input_frames_used == FRAME_BYTES(frame_size));
-            src_float_to_short_array(outframe, outbuf, FRAME_BYTES(frame_size)*2);
-            play_samples = srcdat.output_frames_gen;
+            inbuf = buffer_get_frame(&samples, &gap);
+            if (gap) {
+                // its slot stays ours until we ask for the next frame
+                held = inbuf;
+                held_samples = samples;
+                continue;
+            }
+            if (!inbuf)
+                inbuf = silence;
+        }
+
+        if (config.lazy_decode) {
+            gain.gain = (int64_t)0x10000 << 16;
+            gain.step = 0;
+        } else
+            vol_frame(&gain, samples);
+        if (vol_muted != muted) {
+            // the drift correction is bypassed while muted
+            muted = vol_muted;
+            drift_reset();
+        }
+        if (vol_muted) {
+            // keep up with the drift, but there's nothing to hear
+            int stuffsamp;
+            play_samples = samples + stuff_pick(bf_playback_rate, samples, &stuffsamp);
+            playbuf = silence;
         } else
+#ifdef FANCY_RESAMPLING
+        if (fancy_resampling)
+            play_samples = fancy_buffer(bf_playback_rate, &gain, inbuf, outbuf, samples);
+        else
 #endif
-            play_samples = stuff_buffer(bf_playback_rate, inbuf, outbuf);
-
-        config.output->play(outbuf, play_samples);
+        if (resample_state)
+            play_samples = resample_buffer(bf_playback_rate, &gain, inbuf, outbuf, samples);
+        else
+            play_samples = stuff_buffer(bf_playback_rate, &gain, inbuf, &playbuf, samples);
+
+        // inbuf may be a ring slot, which stays ours until the next
+        // buffer_get_frame, so the output is done with it in time
+        config.output->play(playbuf, play_samples);
+        clock_played_frame(play_samples);
     }
 
     return 0;
@@ -489,35 +1644,57 @@ void player_volume(double f) {
     if (config.output->volume) {
         config.output->volume(linear_volume);
     } else {
-        pthread_mutex_lock(&vol_mutex);
-        volume = linear_volume;
-        fix_volume = 65536.0 * volume;
-        pthread_mutex_unlock(&vol_mutex);
+        atomic_store(&fix_volume, (int)(65536.0 * linear_volume));
     }
 }
 void player_flush(void) {
-    pthread_mutex_lock(&ab_mutex);
-    ab_resync();
-    pthread_mutex_unlock(&ab_mutex);
+    __atomic_add_fetch(&ab_flushes, 1, __ATOMIC_RELEASE);
 }
 
 int player_play(stream_cfg *stream) {
-    if (config.buffer_start_fill > BUFFER_FRAMES)
-        die("specified buffer starting fill %d > buffer size %d",
-            config.buffer_start_fill, BUFFER_FRAMES);
+    // the buffer options were checked by parse_options
+    buffer_frames = config.buffer_frames;
+
+    if (stream->fmtp[7] < 1 || stream->fmtp[7] > ALAC_MAX_CHANNELS)
+        die("unsupported channel count %d", stream->fmtp[7]);
+    channels = stream->fmtp[7] < 2 ? 2 : stream->fmtp[7];
+
+    // pass high resolution sources through at 32 bits if the output can
+    int want_bits = stream->fmtp[3] > 16 ? 32 : 16;
+#ifdef FANCY_RESAMPLING
+    // the libsamplerate path is 16 bit stereo only
+    fancy_resampling = channels == 2;
+    if (fancy_resampling)
+        want_bits = 16;
+#endif
+    output_bits = config.output->start(stream->fmtp[11], channels, want_bits);
 
-    AES_set_decrypt_key(stream->aeskey, 128, &aes);
     aesiv = stream->aesiv;
-    init_decoder(stream->fmtp);
+    aeskey = stream->aeskey;
+    if (init_decoder(stream->fmtp))
+        die("could not set up the decoder");
+    // lazily decoded packets are decoded on the player thread instead
+    nworkers = config.lazy_decode ? 0 : config.decode_threads;
     // must be after decoder init
-    init_buffer();
+    init_buffer(stream->fmtp);
+    init_workers(stream->fmtp);
 #ifdef FANCY_RESAMPLING
     init_src();
+    if (!fancy_resampling)
 #endif
+    if (config.resample) {
+        resample_state = resampler_new(channels, output_bits, frame_size);
+        if (!resample_state)
+            die("could not set up the resampler");
+    }
+
+    clock_reset();
+    pthread_mutex_lock(&clock_mutex);
+    clock_running = 1;
+    pthread_mutex_unlock(&clock_mutex);
 
     please_stop = 0;
     command_start();
-    config.output->start(sampling_rate);
     pthread_create(&player_thread, NULL, player_thread_func, NULL);
 
     return 0;
@@ -526,11 +1703,31 @@ int player_play(stream_cfg *stream) {
 void player_stop(void) {
     please_stop = 1;
     pthread_join(player_thread, NULL);
+    pthread_mutex_lock(&clock_mutex);
+    clock_running = 0;
+    pthread_mutex_unlock(&clock_mutex);
+    if (clock_valid)
+        debug(1, "clock drift %.1f ppm\n", clock_drift * 1e6);
+    if (plc_concealed)
+        debug(1, "concealed %ld frames in %ld bursts\n", plc_concealed, plc_bursts);
+    if (plc_refill)
+        debug(1, "played %ld frames of fade or silence refilling after underruns\n",
+              plc_refill);
+    plc_concealed = plc_bursts = plc_refill = 0;
+    if (resend_requests)
+        debug(1, "asked for %ld frames in %ld resend requests, %ld came back; "
+              "round trip %d ms\n", resend_frames, resend_requests,
+              resend_recovered, resend_srtt);
+    resend_requests = resend_frames = resend_recovered = 0;
     config.output->stop();
     command_stop();
+    free_workers();
     free_buffer();
     free_decoder();
 #ifdef FANCY_RESAMPLING
     free_src();
 #endif
+    if (resample_state)
+        resampler_free(resample_state);
+    resample_state = NULL;
 }
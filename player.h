@@ -27,6 +27,14 @@ void player_cover_clear();
 void player_flush(void);
 void player_resync(void);
 
-void player_put_packet(seq_t seqno, uint8_t *data, int len);
+// data is decrypted in place, and the decoder may read a little past
+// its end: it must be writable and followed by PACKET_PADDING bytes.
+// with config.lazy_decode, it is copied into the buffer instead.
+#define PACKET_PADDING 16
+void player_put_packet(seq_t seqno, uint32_t timestamp, uint8_t *data, int len);
+
+// from the RTP thread: the source's timestamp for a moment on our
+// monotonic clock, in 32.32 fixed point seconds
+void player_clock_sync(uint32_t timestamp, uint64_t local_time);
 
 #endif //_PLAYER_H
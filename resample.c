@@ -0,0 +1,361 @@
+/*
+ * Polyphase resampler for clock drift correction. This file is part of
+ * Shairport.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "resample.h"
+
+#if defined(__SSE__)
+#define RESAMPLE_SSE
+#include <xmmintrin.h>
+#if defined(__SSE2__)
+#define RESAMPLE_SSE2
+#include <emmintrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RESAMPLE_NEON
+#include <arm_neon.h>
+#endif
+
+// a windowed sinc, in PHASES fractional positions between two input
+// samples; positions in between are interpolated from the two nearest.
+// 32 taps with a Kaiser window give about 60 dB of stopband, with the
+// band rolling off from around 0.39 of the sample rate.
+#define TAPS 32
+#define PHASES 64
+#define CUTOFF 0.445        // of the sample rate, at -6 dB
+#define KAISER_BETA 6.0
+#define ALIGN 64
+
+struct resampler {
+    int channels, bits, max_in;
+    float *coef;        // PHASES rows of TAPS
+    float *delta;       // to the next row, so a position is coef + f*delta
+    float *hist;        // planar, stride floats per channel
+    int stride;
+    int len;            // samples per channel in hist
+    double pos;         // where the next output's taps start in hist
+};
+
+// zeroth order modified Bessel function of the first kind
+static double bessel_i0(double x) {
+    double sum = 1.0, term = 1.0;
+    int k;
+    for (k=1; k<50 && term > sum*1e-12; k++) {
+        term *= (x / (2.0*k)) * (x / (2.0*k));
+        sum += term;
+    }
+    return sum;
+}
+
+// tap k of the filter for an output frac of the way past tap TAPS/2-1
+static double filter_tap(int k, double frac) {
+    double d = k - (TAPS/2 - 1) - frac;
+    double w = d / (TAPS/2);
+    double h;
+
+    if (w <= -1.0 || w >= 1.0)
+        return 0.0;
+    w = bessel_i0(KAISER_BETA * sqrt(1.0 - w*w)) / bessel_i0(KAISER_BETA);
+    h = d == 0.0 ? 1.0 : sin(2.0*M_PI*CUTOFF*d) / (2.0*M_PI*CUTOFF*d);
+    return h * w;
+}
+
+static void make_filter(resampler *r) {
+    double row[PHASES+1][TAPS];
+    int p, k;
+
+    for (p=0; p<=PHASES; p++) {
+        double sum = 0.0;
+        for (k=0; k<TAPS; k++)
+            sum += row[p][k] = filter_tap(k, (double)p / PHASES);
+        // unity gain at every position, or the drift would modulate it
+        for (k=0; k<TAPS; k++)
+            row[p][k] /= sum;
+    }
+    for (p=0; p<PHASES; p++) {
+        for (k=0; k<TAPS; k++) {
+            r->coef[p*TAPS + k] = row[p][k];
+            r->delta[p*TAPS + k] = row[p+1][k] - row[p][k];
+        }
+    }
+}
+
+// the filter for one output position, and its dot product with one
+// channel's input. x need not be aligned, the rest is
+#if defined(RESAMPLE_SSE)
+static inline void interp_taps(float *h, const float *c, const float *d, float f) {
+    __m128 vf = _mm_set1_ps(f);
+    int k;
+    for (k=0; k<TAPS; k+=4)
+        _mm_store_ps(h+k, _mm_add_ps(_mm_load_ps(c+k),
+                                     _mm_mul_ps(vf, _mm_load_ps(d+k))));
+}
+
+static inline float dot_taps(const float *x, const float *h) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps(), t;
+    int k;
+    for (k=0; k<TAPS; k+=8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x+k), _mm_load_ps(h+k)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x+k+4), _mm_load_ps(h+k+4)));
+    }
+    acc0 = _mm_add_ps(acc0, acc1);
+    t = _mm_movehl_ps(acc0, acc0);
+    acc0 = _mm_add_ps(acc0, t);
+    t = _mm_shuffle_ps(acc0, acc0, _MM_SHUFFLE(1, 1, 1, 1));
+    return _mm_cvtss_f32(_mm_add_ss(acc0, t));
+}
+#elif defined(RESAMPLE_NEON)
+static inline void interp_taps(float *h, const float *c, const float *d, float f) {
+    int k;
+    for (k=0; k<TAPS; k+=4)
+        vst1q_f32(h+k, vmlaq_n_f32(vld1q_f32(c+k), vld1q_f32(d+k), f));
+}
+
+static inline float dot_taps(const float *x, const float *h) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f), acc1 = vdupq_n_f32(0.0f);
+    float32x2_t s;
+    int k;
+    for (k=0; k<TAPS; k+=8) {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(x+k), vld1q_f32(h+k));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(x+k+4), vld1q_f32(h+k+4));
+    }
+    acc0 = vaddq_f32(acc0, acc1);
+    s = vadd_f32(vget_low_f32(acc0), vget_high_f32(acc0));
+    return vget_lane_f32(vpadd_f32(s, s), 0);
+}
+#else
+static inline void interp_taps(float *h, const float *c, const float *d, float f) {
+    int k;
+    for (k=0; k<TAPS; k++)
+        h[k] = c[k] + f*d[k];
+}
+
+static inline float dot_taps(const float *x, const float *h) {
+    float acc = 0.0f;
+    int k;
+    for (k=0; k<TAPS; k++)
+        acc += x[k] * h[k];
+    return acc;
+}
+#endif
+
+// rounded to nearest, half to even, as the vector conversions are.
+// lrintf is a library call without -fno-math-errno; adding and taking
+// away 1.5 * 2^23 leaves no bits below the point instead, as long as
+// floats are evaluated as floats
+#define ROUND_MAGIC 12582912.0f
+static inline int16_t float_to_s16(float v) {
+    if (v >= 32767.0f)
+        return 32767;
+    if (v <= -32768.0f)
+        return -32768;
+#if FLT_EVAL_METHOD == 0
+    return (int)((v + ROUND_MAGIC) - ROUND_MAGIC);
+#else
+    return (int)rintf(v);
+#endif
+}
+
+static inline int32_t float_to_s32(float v) {
+    // 2^31 is the nearest float to INT32_MAX
+    if (v >= 2147483647.0f)
+        return INT32_MAX;
+    if (v <= -2147483648.0f)
+        return INT32_MIN;
+    return (int32_t)(v + (v < 0.0f ? -0.5f : 0.5f));
+}
+
+resampler *resampler_new(int channels, int sample_bits, int max_in) {
+    resampler *r;
+    size_t head = (sizeof(resampler) + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+    size_t table = PHASES * TAPS * sizeof(float);
+    int stride = (max_in + TAPS + 15) & ~15;
+    size_t size = head + 2*table + channels*stride*sizeof(float);
+    void *mem;
+
+    // the state, the filter and the history all in one block
+    if (posix_memalign(&mem, ALIGN, size))
+        return NULL;
+    memset(mem, 0, size);
+
+    r = mem;
+    r->channels = channels;
+    r->bits = sample_bits;
+    r->max_in = max_in;
+    r->coef = (float*)((char*)mem + head);
+    r->delta = (float*)((char*)r->coef + table);
+    r->hist = (float*)((char*)r->delta + table);
+    r->stride = stride;
+    resampler_reset(r);
+    make_filter(r);
+
+    return r;
+}
+
+void resampler_reset(resampler *r) {
+    memset(r->hist, 0, r->channels * r->stride * sizeof(float));
+    r->len = TAPS/2 - 1;
+    r->pos = 0.0;
+}
+
+void resampler_free(resampler *r) {
+    free(r);
+}
+
+int resampler_process(resampler *r, const void *in, int samples,
+                      void *out, double ratio) {
+    float h[TAPS] __attribute__((aligned(16)));
+    int channels = r->channels;
+    int i, c, ip, n = 0;
+
+    if (samples > r->max_in)
+        samples = r->max_in;
+    if (ratio > 1.0 + RESAMPLE_MAX_DRIFT)
+        ratio = 1.0 + RESAMPLE_MAX_DRIFT;
+    if (ratio < 1.0 - RESAMPLE_MAX_DRIFT)
+        ratio = 1.0 - RESAMPLE_MAX_DRIFT;
+
+    // deinterleave the block after what's left of the last one
+    for (c=0; c<channels; c++) {
+        float *x = r->hist + c*r->stride + r->len;
+        if (r->bits == 32) {
+            const int32_t *s = (const int32_t*)in + c;
+            for (i=0; i<samples; i++)
+                x[i] = s[i*channels];
+        } else {
+            const int16_t *s = (const int16_t*)in + c;
+            for (i=0; i<samples; i++)
+                x[i] = s[i*channels];
+        }
+    }
+    r->len += samples;
+
+    while ((ip = (int)r->pos) + TAPS <= r->len) {
+        double frac = (r->pos - ip) * PHASES;
+        int p = (int)frac;
+        interp_taps(h, r->coef + p*TAPS, r->delta + p*TAPS, frac - p);
+
+        if (r->bits == 32) {
+            int32_t *o = (int32_t*)out + n*channels;
+            for (c=0; c<channels; c++)
+                o[c] = float_to_s32(dot_taps(r->hist + c*r->stride + ip, h));
+        } else {
+            int16_t *o = (int16_t*)out + n*channels;
+            for (c=0; c<channels; c++)
+                o[c] = float_to_s16(dot_taps(r->hist + c*r->stride + ip, h));
+        }
+        n++;
+        r->pos += ratio;
+    }
+
+    // keep the input the next outputs still need
+    ip = (int)r->pos;
+    for (c=0; c<channels; c++) {
+        float *x = r->hist + c*r->stride;
+        memmove(x, x + ip, (r->len - ip) * sizeof(float));
+    }
+    r->len -= ip;
+    r->pos -= ip;
+
+    return n;
+}
+
+void resample_stereo_to_float(const int16_t *in, float *out, int frames,
+                              float gain, float step) {
+    int i = 0;
+
+#if defined(RESAMPLE_SSE2)
+    // four frames at a time, two gains to a vector
+    __m128 g0 = _mm_setr_ps(gain, gain, gain + step, gain + step);
+    __m128 g1 = _mm_add_ps(g0, _mm_set1_ps(2.0f * step));
+    __m128 dg = _mm_set1_ps(4.0f * step);
+    for (; i + 4 <= frames; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(in + 2*i));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_ps(out + 2*i, _mm_mul_ps(_mm_cvtepi32_ps(lo), g0));
+        _mm_storeu_ps(out + 2*i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), g1));
+        g0 = _mm_add_ps(g0, dg);
+        g1 = _mm_add_ps(g1, dg);
+    }
+    gain += i * step;
+#elif defined(RESAMPLE_NEON)
+    float32x4_t g0 = vcombine_f32(vdup_n_f32(gain), vdup_n_f32(gain + step));
+    float32x4_t g1 = vaddq_f32(g0, vdupq_n_f32(2.0f * step));
+    float32x4_t dg = vdupq_n_f32(4.0f * step);
+    for (; i + 4 <= frames; i += 4) {
+        int16x8_t x = vld1q_s16(in + 2*i);
+        vst1q_f32(out + 2*i, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))), g0));
+        vst1q_f32(out + 2*i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))), g1));
+        g0 = vaddq_f32(g0, dg);
+        g1 = vaddq_f32(g1, dg);
+    }
+    gain += i * step;
+#endif
+    for (; i < frames; i++) {
+        out[2*i] = in[2*i] * gain;
+        out[2*i+1] = in[2*i+1] * gain;
+        gain += step;
+    }
+}
+
+void resample_float_to_s16(const float *in, int16_t *out, int samples) {
+    int i = 0;
+
+#if defined(RESAMPLE_SSE2)
+    // clamped first: out of range conversions give INT32_MIN
+    __m128 k = _mm_set1_ps(32768.0f);
+    __m128 hi = _mm_set1_ps(32767.0f), lo = _mm_set1_ps(-32768.0f);
+    for (; i + 8 <= samples; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(in + i), k);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(in + i + 4), k);
+        a = _mm_max_ps(_mm_min_ps(a, hi), lo);
+        b = _mm_max_ps(_mm_min_ps(b, hi), lo);
+        _mm_storeu_si128((__m128i*)(out + i),
+                         _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+    }
+#elif defined(RESAMPLE_NEON)
+    // vcvtq truncates, so round to nearest even first, as float_to_s16
+    // does; the clamp keeps that in range. the narrowing saturates
+    float32x4_t k = vdupq_n_f32(32768.0f), magic = vdupq_n_f32(ROUND_MAGIC);
+    float32x4_t hi = vdupq_n_f32(32767.0f), lo = vdupq_n_f32(-32768.0f);
+    for (; i + 8 <= samples; i += 8) {
+        float32x4_t a = vmulq_f32(vld1q_f32(in + i), k);
+        float32x4_t b = vmulq_f32(vld1q_f32(in + i + 4), k);
+        a = vmaxq_f32(vminq_f32(a, hi), lo);
+        b = vmaxq_f32(vminq_f32(b, hi), lo);
+        a = vsubq_f32(vaddq_f32(a, magic), magic);
+        b = vsubq_f32(vaddq_f32(b, magic), magic);
+        vst1q_s16(out + i, vcombine_s16(vqmovn_s32(vcvtq_s32_f32(a)),
+                                        vqmovn_s32(vcvtq_s32_f32(b))));
+    }
+#endif
+    for (; i < samples; i++)
+        out[i] = float_to_s16(in[i] * 32768.0f);
+}
@@ -0,0 +1,41 @@
+#ifndef _RESAMPLE_H
+#define _RESAMPLE_H
+
+#include <stdint.h>
+
+// a small polyphase resampler for clock drift correction: the ratio may
+// change from one block to the next, but only by a fraction of a percent
+// either side of 1. much cheaper than a general purpose sample rate
+// converter, at the cost of some treble right at the top of the band.
+typedef struct resampler resampler;
+
+// the ratio is clamped to within this of 1
+#define RESAMPLE_MAX_DRIFT (1.0/256.0)
+
+// room needed for the output of a block of n input samples
+#define RESAMPLE_MAX_OUT(n) ((n) + (n)/128 + 2)
+
+// sample_bits is 16 or 32: interleaved, signed, native endian, as for the
+// audio outputs. blocks may be up to max_in samples long.
+resampler *resampler_new(int channels, int sample_bits, int max_in);
+void resampler_free(resampler *r);
+// forget the history and the phase, for a new stream: the next output
+// is centred on the next input, as for a new resampler
+void resampler_reset(resampler *r);
+
+// ratio is input samples consumed per output sample, so above 1 plays
+// faster. returns the number of samples written to out; the resampler
+// delays the audio by a few samples, and keeps them for the next block.
+int resampler_process(resampler *r, const void *in, int samples,
+                      void *out, double ratio);
+
+// conversions for a float resampler such as libsamplerate, full scale
+// +-1.0 as its src_short_to_float_array and src_float_to_short_array,
+// but vectorised. the input is stereo, each frame scaled by gain, which
+// then moves by step for a volume ramp; unity is 1/32768.
+void resample_stereo_to_float(const int16_t *in, float *out, int frames,
+                              float gain, float step);
+// clipped, rounded to nearest
+void resample_float_to_s16(const float *in, int16_t *out, int samples);
+
+#endif //_RESAMPLE_H
@@ -28,6 +28,8 @@
 #include <signal.h>
 #include <unistd.h>
 #include <memory.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -40,25 +42,145 @@ static int running = 0;
 static int please_shutdown;
 
 static SOCKADDR rtp_client;
+static SOCKADDR rtp_timing;
+static int timing_port;
 static int sock;
 static pthread_t rtp_thread;
 
+// the timing exchange, RTP thread only. every few seconds we ask the
+// source for its NTP clock, and like NTP take the offset from whichever
+// of the last few replies came back quickest. times are 32.32 fixed
+// point seconds; ours are from the monotonic clock, which the source
+// only echoes back to us.
+//
+// which reply is quickest changes, and each is out by its own share of
+// the path's asymmetry, so that offset moves in steps that clock
+// recovery would take for the source's clock jumping. what we pass on
+// follows it by 1/TIMING_SMOOTH of the difference at each reply; only a
+// difference over TIMING_STEP, a real jump, is taken at once.
+#define TIMING_INTERVAL 3   // seconds
+#define TIMING_SAMPLES 8
+#define TIMING_SMOOTH 8
+#define TIMING_STEP (((uint64_t)1 << 32) / 20)  // 50ms
+static struct {
+    int64_t delay;
+    uint64_t offset;    // the source's clock less ours
+} timing[TIMING_SAMPLES];
+static int timing_count;
+static uint64_t timing_sent;
+static uint64_t timing_smoothed;
+
+static uint64_t local_ntp(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec << 32) + ((uint64_t)ts.tv_nsec << 32) / 1000000000;
+}
+
+static uint64_t get_ntp(uint8_t *p) {
+    return ((uint64_t)ntohl(*(uint32_t *)p) << 32) | ntohl(*(uint32_t *)(p+4));
+}
+
+static void put_ntp(uint8_t *p, uint64_t t) {
+    *(uint32_t *)p = htonl(t >> 32);
+    *(uint32_t *)(p+4) = htonl(t);
+}
+
+static void timing_request(void) {
+    uint8_t req[32];
+    memset(req, 0, sizeof(req));
+    req[0] = 0x80;
+    req[1] = 0x52|0x80;     // Apple 'timing request'
+    *(unsigned short *)(req+2) = htons(7);
+    timing_sent = local_ntp();
+    put_ntp(req+24, timing_sent);
+
+    sendto(sock, req, sizeof(req), 0, (struct sockaddr*)&rtp_timing, sizeof(rtp_timing));
+}
+
+static void timing_tick(void) {
+    if (timing_port && local_ntp() - timing_sent >= (uint64_t)TIMING_INTERVAL << 32)
+        timing_request();
+}
+
+static void timing_reply(uint8_t *pkt, ssize_t len) {
+    uint64_t t1, t2, t3, t4 = local_ntp();
+    int64_t delay, step;
+    int i, n, best = -1;
+
+    if (len < 32)
+        return;
+    t1 = get_ntp(pkt+8);    // our request, sent
+    t2 = get_ntp(pkt+16);   // received, by their clock
+    t3 = get_ntp(pkt+24);   // replied, by their clock
+    if (t1 != timing_sent)  // a late reply to an earlier one
+        return;
+    delay = (int64_t)((t4 - t1) - (t3 - t2));
+    if (delay < 0)
+        return;
+
+    i = timing_count++ % TIMING_SAMPLES;
+    timing[i].delay = delay;
+    timing[i].offset = (t2 - t1) - (uint64_t)(delay / 2);
+    debug(3, "timing reply: round trip %lld us\n",
+          (long long)((delay * 1000000) >> 32));
+
+    n = timing_count < TIMING_SAMPLES ? timing_count : TIMING_SAMPLES;
+    for (i=0; i<n; i++)
+        if (best < 0 || timing[i].delay < timing[best].delay)
+            best = i;
+    step = (int64_t)(timing[best].offset - timing_smoothed);
+    if (timing_count == 1 || step > (int64_t)TIMING_STEP || step < -(int64_t)TIMING_STEP)
+        timing_smoothed = timing[best].offset;
+    else
+        timing_smoothed += step / TIMING_SMOOTH;
+}
+
+static int timing_offset(uint64_t *offset) {
+    if (!timing_count)
+        return 0;
+    *offset = timing_smoothed;
+    return 1;
+}
+
+// the source's timestamp for a moment on its NTP clock. we pass it on
+// by our own clock, once the timing exchange lets us
+static void sync_packet(uint8_t *pkt, ssize_t len) {
+    uint64_t offset;
+
+    if (len < 20)
+        return;
+    if (!timing_offset(&offset))
+        return;
+    player_clock_sync(ntohl(*(uint32_t *)(pkt+16)), get_ntp(pkt+8) - offset);
+}
+
 static void *rtp_receiver(void *arg) {
     // we inherit the signal mask (SIGUSR1)
-    uint8_t packet[2048], *pktp;
+    uint8_t packet[2048 + PACKET_PADDING], *pktp;
 
     ssize_t nread;
     while (1) {
         if (please_shutdown)
             break;
-        nread = recv(sock, packet, sizeof(packet), 0);
+        nread = recv(sock, packet, sizeof(packet) - PACKET_PADDING, 0);
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            timing_tick();  // nothing for a while
+            continue;
+        }
         if (nread < 0)
             break;
+        timing_tick();
 
         ssize_t plen = nread;
         uint8_t type = packet[1] & ~0x80;
-        if (type == 0x54) // sync
+        if (type == 0x54) { // sync
+            sync_packet(packet, nread);
+            continue;
+        }
+        if (type == 0x53) { // timing reply
+            timing_reply(packet, nread);
             continue;
+        }
         if (type == 0x60 || type == 0x56) {   // audio data / resend
             pktp = packet;
             if (type==0x56) {
@@ -66,13 +188,14 @@ static void *rtp_receiver(void *arg) {
                 plen -= 4;
             }
             seq_t seqno = ntohs(*(unsigned short *)(pktp+2));
+            uint32_t timestamp = ntohl(*(uint32_t *)(pktp+4));
 
             pktp += 12;
             plen -= 12;
 
             // check if packet contains enough content to be reasonable
             if (plen >= 16) {
-                player_put_packet(seqno, pktp, plen);
+                player_put_packet(seqno, timestamp, pktp, plen);
                 continue;
             }
             if (type == 0x56 && seqno == 0) {
@@ -137,23 +260,30 @@ int rtp_setup(SOCKADDR *remote, int cport, int tport) {
 
     debug(1, "rtp_setup: cport=%d tport=%d\n", cport, tport);
 
-    // we do our own timing and ignore the timing port.
-    // an audio perfectionist may wish to learn the protocol.
-
+    // the source's sync packets come to us on the same port as its audio,
+    // and we ask it the time on its timing port, see timing_request
     memcpy(&rtp_client, remote, sizeof(rtp_client));
+    memcpy(&rtp_timing, remote, sizeof(rtp_timing));
 #ifdef AF_INET6
     if (rtp_client.SAFAMILY == AF_INET6) {
-        struct sockaddr_in6 *sa6 = (struct sockaddr_in6*)&rtp_client;
-        sa6->sin6_port = htons(cport);
+        ((struct sockaddr_in6*)&rtp_client)->sin6_port = htons(cport);
+        ((struct sockaddr_in6*)&rtp_timing)->sin6_port = htons(tport);
     } else
 #endif
     {
-        struct sockaddr_in *sa = (struct sockaddr_in*)&rtp_client;
-        sa->sin_port = htons(cport);
+        ((struct sockaddr_in*)&rtp_client)->sin_port = htons(cport);
+        ((struct sockaddr_in*)&rtp_timing)->sin_port = htons(tport);
     }
+    timing_port = tport;
+    timing_count = 0;
+    timing_sent = 0;
 
     int sport = bind_port(remote);
 
+    // wake up now and then to ask the time, even with no audio coming
+    struct timeval tv = {1, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
     debug(1, "rtp listening on port %d\n", sport);
 
     please_shutdown = 0;
@@ -176,8 +306,9 @@ void rtp_shutdown(void) {
 }
 
 void rtp_request_resend(seq_t first, seq_t last) {
+    // the player thread may still be asking as the stream shuts down
     if (!running)
-        die("rtp_request_resend called without active stream!");
+        return;
 
     debug(1, "requesting resend on %d packets (%04X:%04X)\n",
          seq_diff(first,last) + 1, first, last);
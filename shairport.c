@@ -95,6 +95,26 @@ void usage(char *progname) {
     printf("    -k, --password=PW   require password to stream audio\n");
     printf("    -b FILL             set how full the buffer must be before audio output\n");
     printf("                        starts. This value is in frames; default %d\n", config.buffer_start_fill);
+    printf("    -R, --refill=FILL   after an underrun, resume once the buffer holds FILL\n");
+    printf("                        frames again; default %d, or FILL of -b if less\n", config.buffer_refill);
+    printf("    -A, --adaptive-fill=MIN  follow the network's jitter and loss with the\n");
+    printf("                        buffer's fill, and so latency, down to MIN frames.\n");
+    printf("                        The starting fill is the most it will use\n");
+    printf("    -F, --buffer-frames=N   set the size of the jitter buffer, in frames.\n");
+    printf("                        A power of 2 up to 16384; default %d\n", config.buffer_frames);
+    printf("    -L, --lazy-decode   buffer packets as received and decode each one\n");
+    printf("                        just before it is played, applying the soft\n");
+    printf("                        volume as it goes\n");
+    printf("    -j, --decode-threads=N  decode packets on N worker threads, off the\n");
+    printf("                        network thread. 0 decodes as they arrive; default %d\n", config.decode_threads);
+    printf("    -S, --stuffing=MODE how to follow the source's clock: \"basic\" to add\n");
+    printf("                        or drop single samples now and then (default), or\n");
+    printf("                        \"resample\" smoothly. With \"basic\", a frame at full\n");
+    printf("                        software volume (e.g. with a hardware mixer) that\n");
+    printf("                        needs no stuffing is played straight from the buffer.\n");
+    printf("                        \"resample\" rewrites every frame, so it never is\n");
+    printf("    -r, --volume-ramp=MS    spread software volume changes over MS\n");
+    printf("                        milliseconds; default %d\n", config.volume_ramp);
     printf("    -d, --daemon        fork (daemonise). The PID of the child process is\n");
     printf("                        written to stdout, unless a pidfile is used.\n");
     printf("    -P, --pidfile=FILE  write daemon's pid to FILE on startup.\n");
@@ -138,12 +158,19 @@ int parse_options(int argc, char **argv) {
         {"wait-cmd",  no_argument,        NULL, 'w'},
         {"meta-dir",  required_argument,  NULL, 'M'},
         {"mdns",      required_argument,  NULL, 'm'},
+        {"buffer-frames", required_argument, NULL, 'F'},
+        {"refill",    required_argument,  NULL, 'R'},
+        {"adaptive-fill", required_argument, NULL, 'A'},
+        {"lazy-decode", no_argument,      NULL, 'L'},
+        {"decode-threads", required_argument, NULL, 'j'},
+        {"stuffing",  required_argument,  NULL, 'S'},
+        {"volume-ramp", required_argument, NULL, 'r'},
         {NULL,        0,                  NULL,   0}
     };
 
-    int opt;
+    int opt, refill_set = 0;
     while ((opt = getopt_long(argc, argv,
-                              "+hdvP:l:e:p:a:k:o:b:B:E:M:wm:",
+                              "+hdvP:l:e:p:a:k:o:b:R:A:F:Lj:S:r:B:E:M:wm:",
                               long_options, NULL)) > 0) {
         switch (opt) {
             default:
@@ -173,6 +200,35 @@ int parse_options(int argc, char **argv) {
             case 'b':
                 config.buffer_start_fill = atoi(optarg);
                 break;
+            case 'R':
+                config.buffer_refill = atoi(optarg);
+                refill_set = 1;
+                break;
+            case 'A':
+                config.adaptive_fill = atoi(optarg);
+                break;
+            case 'F':
+                config.buffer_frames = atoi(optarg);
+                break;
+            case 'L':
+                config.lazy_decode = 1;
+                break;
+            case 'j':
+                config.decode_threads = atoi(optarg);
+                break;
+            case 'S':
+                if (!strcmp(optarg, "basic"))
+                    config.resample = 0;
+                else if (!strcmp(optarg, "resample"))
+                    config.resample = 1;
+                else
+                    die("unknown stuffing mode %s", optarg);
+                break;
+            case 'r':
+                config.volume_ramp = atoi(optarg);
+                if (config.volume_ramp < 0 || config.volume_ramp > 10000)
+                    die("volume ramp %d ms out of range 0-10000", config.volume_ramp);
+                break;
             case 'B':
                 config.cmd_start = optarg;
                 break;
@@ -199,6 +255,27 @@ int parse_options(int argc, char **argv) {
                 break;
         }
     }
+
+    // the buffer options depend on each other, so they're checked once
+    // all are in, rather than when the first client connects
+    if (config.buffer_frames < 16 || config.buffer_frames > 16384 ||
+        (config.buffer_frames & (config.buffer_frames-1)))
+        die("buffer size %d is not a power of 2 between 16 and 16384",
+            config.buffer_frames);
+    if (config.buffer_start_fill < 1 || config.buffer_start_fill >= config.buffer_frames)
+        die("buffer starting fill %d must be at least 1 and below the buffer size %d",
+            config.buffer_start_fill, config.buffer_frames);
+    if (config.adaptive_fill < 0 || config.adaptive_fill > config.buffer_start_fill)
+        die("adaptive minimum fill %d must be between 0 (off) and the starting fill %d",
+            config.adaptive_fill, config.buffer_start_fill);
+    // the default refill is for the default starting fill
+    if (!refill_set && config.buffer_refill > config.buffer_start_fill)
+        config.buffer_refill = config.buffer_start_fill;
+    if (config.buffer_refill < 1 || config.buffer_refill > config.buffer_start_fill)
+        die("buffer refill %d must be between 1 and the starting fill %d",
+            config.buffer_refill, config.buffer_start_fill);
+    if (config.decode_threads < 0 || config.decode_threads > 16)
+        die("decode threads %d out of range 0-16", config.decode_threads);
     return optind;
 }
 
@@ -279,6 +356,11 @@ int main(int argc, char **argv) {
 
     // set defaults
     config.buffer_start_fill = 220;
+    config.buffer_refill = 8;
+    config.buffer_frames = 512;
+    config.decode_threads = 0;
+    config.resample = 0;
+    config.volume_ramp = 20;
     config.port = 5002;
     char hostname[100];
     gethostname(hostname, 100);